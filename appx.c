@@ -22,17 +22,20 @@
 static void
 dohash(int fd, u64 size, unsigned char *out)
 {
-  unsigned char buf[65536];
+  struct stream *st = stream_open(fd, size);
+  const unsigned char *buf;
   HASH_CONTEXT ctx;
+  size_t chunk;
 
   hash_init(&ctx);
   while (size > 0)
     {
-      int chunk = size > sizeof(buf) ? sizeof(buf) : size;
-      doread(fd, buf, chunk);
+      if (!(chunk = stream_read(st, &buf)))
+	dodie("unexpeced EOF");
       hash_write(&ctx, buf, chunk);
       size -= chunk;
     }
+  stream_close(st);
   hash_final(&ctx);
   memcpy(out, hash_read(&ctx), hash_len());
 }
@@ -85,7 +88,20 @@ appx_create_contentinfo(struct appxdata *appxdata, int fd)
 
   /* hash from central dir to end */
   memcpy(dp, axcdsig, 4);
-  dohash(fd, appxdata->zip.size - appxdata->zip.cd_offset, dp + 4);
+  if (appxdata->resigned)
+    {
+      /* the old signature is gone, hash the new central dir */
+      HASH_CONTEXT ctx;
+      u64 taillen;
+      unsigned char *tail = zip_gettail(&appxdata->zip, &taillen);
+      hash_init(&ctx);
+      hash_write(&ctx, tail, taillen);
+      hash_final(&ctx);
+      memcpy(dp + 4, hash_read(&ctx), hlen);
+      free(tail);
+    }
+  else
+    dohash(fd, appxdata->zip.size - appxdata->zip.cd_offset, dp + 4);
   dp += 4 + hlen;
 
   /* hash content types */
@@ -122,7 +138,7 @@ appx_create_signedattrs(struct appxdata *appxdata, int offset, time_t t)
 }
 
 int
-appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx, time_t t)
+appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx, time_t t, int resign)
 {
   int offset;
 
@@ -130,7 +146,16 @@ appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx,
   zip_read(&appxdata->zip, fd);
 
   if (zip_findentry(&appxdata->zip, "AppxSignature.p7x"))
-    return 0;
+    {
+      if (!resign)
+	return 0;
+      if (!zip_removelast(&appxdata->zip, "AppxSignature.p7x"))
+	{
+	  fprintf(stderr, "%s: AppxSignature.p7x is not the last file\n", filename);
+	  exit(1);
+	}
+      appxdata->resigned = 1;
+    }
 
   /* create spccontentinfo */
   offset = appx_create_contentinfo(appxdata, fd);
@@ -141,17 +166,24 @@ appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx,
   return 1;
 }
 
+static void
+appx_signature(struct appxdata *appxdata, struct x509 *cb, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
+{
+  static const unsigned char p7xmagic[4] = { 0x50, 0x4b, 0x43, 0x58 };
+
+  x509_pkcs7_signed_data(cb, &appxdata->cb_content, &appxdata->cb_signedattrs, pubalgo, sigcb, cert, othercerts, 0);
+  /* prepend file magic */
+  x509_insert(cb, 0, p7xmagic, sizeof(p7xmagic));
+}
+
 void
 appx_write(struct appxdata *appxdata, int outfd, int fd, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
 {
-  static const unsigned char p7xmagic[4] = { 0x50, 0x4b, 0x43, 0x58 };
   struct x509 cb;
   extern int appxdetached;
 
   x509_init(&cb);
-  x509_pkcs7_signed_data(&cb, &appxdata->cb_content, &appxdata->cb_signedattrs, pubalgo, sigcb, cert, othercerts, 0);
-  /* prepend file magic */
-  x509_insert(&cb, 0, p7xmagic, sizeof(p7xmagic));
+  appx_signature(appxdata, &cb, cert, pubalgo, sigcb, othercerts);
   if (appxdetached)
     {
       dowrite(outfd, cb.buf, cb.len);
@@ -164,6 +196,19 @@ appx_write(struct appxdata *appxdata, int outfd, int fd, struct x509 *cert, int
   x509_free(&cb);
 }
 
+/* add the signature without copying the zip contents */
+void
+appx_write_inplace(struct appxdata *appxdata, int fd, char *filename, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
+{
+  struct x509 cb;
+
+  x509_init(&cb);
+  appx_signature(appxdata, &cb, cert, pubalgo, sigcb, othercerts);
+  zip_appendfile(&appxdata->zip, "AppxSignature.p7x", cb.buf, cb.len, 8, appxdata->datetime);
+  zip_write_inplace(&appxdata->zip, fd, filename);
+  x509_free(&cb);
+}
+
 void
 appx_free(struct appxdata *appxdata)
 {
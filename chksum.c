@@ -0,0 +1,251 @@
+#include <pthread.h>
+
+#include "inc.h"
+
+/* Checksum engine for the -S checksum file: every selected digest is
+ * computed by its own worker thread. The data is passed through a
+ * small ring of buffers that the workers only read; a buffer is
+ * reused once all workers are done with it.
+ */
+
+#define CHKSUM_NBUF	8
+
+struct chksum_buf {
+  byte data[CHKSUM_BUFSIZE];
+  size_t len;
+  int refs;		/* workers still reading this buffer */
+};
+
+struct chksum_worker {
+  struct chksum *cs;
+  int digest;
+  MD5_CTX md5;
+  HASH_CONTEXT ctx;
+  u64 seq;		/* number of buffers consumed */
+  pthread_t thread;
+};
+
+struct chksum {
+  int nworkers;
+  int threaded;
+  struct chksum_worker workers[CHKSUM_NDIGESTS];
+  struct chksum_buf bufs[CHKSUM_NBUF];
+  u64 produced;		/* number of buffers handed to the workers */
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond_data;
+  pthread_cond_t cond_free;
+};
+
+static const int chksum_hashalgo[CHKSUM_NDIGESTS] = { -1, HASH_SHA1, HASH_SHA256, HASH_SHA512 };
+
+static void
+chksum_update(struct chksum_worker *w, const byte *buf, size_t len)
+{
+  if (w->digest == CHKSUM_MD5)
+    md5_write(&w->md5, buf, len);
+  else
+    hash_write(&w->ctx, buf, len);
+}
+
+static void *
+chksum_thread(void *arg)
+{
+  struct chksum_worker *w = arg;
+  struct chksum *cs = w->cs;
+  struct chksum_buf *b;
+
+  pthread_mutex_lock(&cs->lock);
+  for (;;)
+    {
+      while (w->seq == cs->produced && !cs->done)
+	pthread_cond_wait(&cs->cond_data, &cs->lock);
+      if (w->seq == cs->produced)
+	break;
+      b = cs->bufs + w->seq % CHKSUM_NBUF;
+      pthread_mutex_unlock(&cs->lock);
+      chksum_update(w, b->data, b->len);
+      pthread_mutex_lock(&cs->lock);
+      w->seq++;
+      if (--b->refs == 0)
+	pthread_cond_signal(&cs->cond_free);
+    }
+  pthread_mutex_unlock(&cs->lock);
+  return 0;
+}
+
+struct chksum *
+chksum_start(int digests)
+{
+  struct chksum *cs = doalloc(sizeof(*cs));
+  struct chksum_worker *w;
+  int i;
+
+  memset(cs, 0, sizeof(*cs));
+  for (i = 0; i < CHKSUM_NDIGESTS; i++)
+    {
+      if (!(digests & (1 << i)))
+	continue;
+      w = cs->workers + cs->nworkers++;
+      w->cs = cs;
+      w->digest = i;
+      if (i == CHKSUM_MD5)
+	md5_init(&w->md5);
+      else
+	hash_init_algo(&w->ctx, chksum_hashalgo[i]);
+    }
+  /* threads only pay off with more than one digest and cpu */
+  if (cs->nworkers < 2 || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    return cs;
+  /* let the hash code pick its transforms before the threads run */
+  for (i = 0, w = cs->workers; i < cs->nworkers; i++, w++)
+    {
+      byte zero[128];
+      MD5_CTX md5;
+      HASH_CONTEXT ctx;
+      memset(zero, 0, sizeof(zero));
+      if (w->digest == CHKSUM_MD5)
+	{
+	  md5_init(&md5);
+	  md5_write(&md5, zero, sizeof(zero));
+	}
+      else
+	{
+	  hash_init_algo(&ctx, chksum_hashalgo[w->digest]);
+	  hash_write(&ctx, zero, sizeof(zero));
+	}
+    }
+  pthread_mutex_init(&cs->lock, 0);
+  pthread_cond_init(&cs->cond_data, 0);
+  pthread_cond_init(&cs->cond_free, 0);
+  for (i = 0; i < cs->nworkers; i++)
+    if (pthread_create(&cs->workers[i].thread, 0, chksum_thread, cs->workers + i))
+      break;
+  if (i < cs->nworkers)
+    {
+      /* could not start all threads, do the work ourself */
+      pthread_mutex_lock(&cs->lock);
+      cs->done = 1;
+      pthread_cond_broadcast(&cs->cond_data);
+      pthread_mutex_unlock(&cs->lock);
+      while (i-- > 0)
+	pthread_join(cs->workers[i].thread, 0);
+      cs->done = 0;
+      pthread_mutex_destroy(&cs->lock);
+      pthread_cond_destroy(&cs->cond_data);
+      pthread_cond_destroy(&cs->cond_free);
+      return cs;
+    }
+  cs->threaded = 1;
+  return cs;
+}
+
+/* return the next buffer to fill, at most CHKSUM_BUFSIZE bytes */
+byte *
+chksum_getbuf(struct chksum *cs)
+{
+  struct chksum_buf *b = cs->bufs + cs->produced % CHKSUM_NBUF;
+
+  if (!cs->threaded)
+    return b->data;
+  pthread_mutex_lock(&cs->lock);
+  while (b->refs)
+    pthread_cond_wait(&cs->cond_free, &cs->lock);
+  pthread_mutex_unlock(&cs->lock);
+  return b->data;
+}
+
+/* hand the buffer returned by chksum_getbuf to the workers */
+void
+chksum_putbuf(struct chksum *cs, size_t len)
+{
+  struct chksum_buf *b = cs->bufs + cs->produced % CHKSUM_NBUF;
+  int i;
+
+  if (!cs->threaded)
+    {
+      for (i = 0; i < cs->nworkers; i++)
+	chksum_update(cs->workers + i, b->data, len);
+      cs->produced++;
+      return;
+    }
+  pthread_mutex_lock(&cs->lock);
+  b->len = len;
+  b->refs = cs->nworkers;
+  cs->produced++;
+  pthread_cond_broadcast(&cs->cond_data);
+  pthread_mutex_unlock(&cs->lock);
+}
+
+void
+chksum_write(struct chksum *cs, const byte *buf, size_t len)
+{
+  while (len > 0)
+    {
+      size_t chunk = len > CHKSUM_BUFSIZE ? CHKSUM_BUFSIZE : len;
+      memcpy(chksum_getbuf(cs), buf, chunk);
+      chksum_putbuf(cs, chunk);
+      buf += chunk;
+      len -= chunk;
+    }
+}
+
+/* wait for the workers and store the digests of the selected
+ * checksums in out[], then free the engine */
+void
+chksum_finish(struct chksum *cs, byte **out)
+{
+  struct chksum_worker *w;
+  int i;
+
+  if (cs->threaded)
+    {
+      pthread_mutex_lock(&cs->lock);
+      cs->done = 1;
+      pthread_cond_broadcast(&cs->cond_data);
+      pthread_mutex_unlock(&cs->lock);
+      for (i = 0; i < cs->nworkers; i++)
+	pthread_join(cs->workers[i].thread, 0);
+      pthread_mutex_destroy(&cs->lock);
+      pthread_cond_destroy(&cs->cond_data);
+      pthread_cond_destroy(&cs->cond_free);
+    }
+  for (i = 0, w = cs->workers; i < cs->nworkers; i++, w++)
+    {
+      if (w->digest == CHKSUM_MD5)
+	md5_final(out[w->digest], &w->md5);
+      else
+	{
+	  hash_final(&w->ctx);
+	  memcpy(out[w->digest], hash_read(&w->ctx), hash_algo_len(w->ctx.algo));
+	}
+    }
+  free(cs);
+}
+
+/* parse a list of digest names, e.g. "md5 sha1 sha256 sha512" */
+int
+chksum_parse(const char *str)
+{
+  static const char *names[CHKSUM_NDIGESTS] = { "md5", "sha1", "sha256", "sha512" };
+  int digests = 0, i;
+  size_t l;
+
+  for (;;)
+    {
+      while (*str == ' ' || *str == '\t' || *str == ',')
+	str++;
+      if (!*str)
+	break;
+      for (l = 0; str[l] && str[l] != ' ' && str[l] != '\t' && str[l] != ','; l++)
+	;
+      for (i = 0; i < CHKSUM_NDIGESTS; i++)
+	if (strlen(names[i]) == l && !strncmp(str, names[i], l))
+	  break;
+      if (i == CHKSUM_NDIGESTS)
+	return -1;
+      digests |= 1 << i;
+      str += l;
+    }
+  return digests;
+}
@@ -23,27 +23,48 @@
 
 #include "inc.h"
 
+/* write one line (without the newline) and hash it with trailing
+ * whitespace removed */
+static void
+clearsign_line(FILE *fout, HASH_CONTEXT *ctx, const byte *line, size_t i, int *nlp)
+{
+  size_t j;
+
+  if (*nlp)
+    hash_write(ctx, (const unsigned char *)"\r\n",  2);
+  if ((i > 0 && line[0] == '-') || (i > 4 && !strncmp((const char *)line, "From ", 5)))
+    fprintf(fout, "- ");
+  fwrite(line, 1, i, fout);
+  putc('\n', fout);
+  for (j = i; j > 0; j--)
+    if (line[j - 1] != '\r' && line[j - 1] != ' ' && line[j - 1] != '\t')
+      break;
+  if (j > 0)
+    hash_write(ctx, line, j);
+  *nlp = 1;
+}
+
 int
 clearsign(int fd, char *filename, char *outfilename, HASH_CONTEXT *ctx, const char *hname, int isfilter, int force, FILE **foutp)
 {
-  byte *cbuf;
-  int l, cbufl;
-  int have = 0;
-  int i, j;
+  struct stream *st;
+  const byte *buf, *p, *q, *end;
+  byte *cbuf = 0;
+  size_t l, i, have = 0;
   int nl = 0;
   int first = 1;
   FILE *fout;
 
-  cbufl = 8192;
-  cbuf = doalloc(cbufl);
-  l = read(fd, cbuf, cbufl);
-  if (l < 0)
-    dodie_errno("read");
-  if (l >= 34 && !strncmp((char *)cbuf, "-----BEGIN PGP SIGNED MESSAGE-----", 34))
-    return 0;	/* already signed */
-  for (i = 0; i < l; i++)
+  st = stream_open(fd, STREAM_TOEOF);
+  l = stream_read(st, &buf);
+  if (l >= 34 && !strncmp((const char *)buf, "-----BEGIN PGP SIGNED MESSAGE-----", 34))
+    {
+      stream_close(st);
+      return 0;	/* already signed */
+    }
+  for (i = 0; i < l && i < 8192; i++)
     {
-      if (cbuf[i] >= 32 || cbuf[i] == '\t' || cbuf[i] == '\r' || cbuf[i] == '\n')
+      if (buf[i] >= 32 || buf[i] == '\t' || buf[i] == '\r' || buf[i] == '\n')
 	continue;
       first++;
     }
@@ -52,58 +73,43 @@ clearsign(int fd, char *filename, char *outfilename, HASH_CONTEXT *ctx, const ch
       fprintf(stderr, "%s: won't clearsign binaries\n", filename);
       exit(1);
     }
-  opensocket();
   if (isfilter)
     fout = stdout;
   else if ((fout = fopen(outfilename, "w")) == 0)
     dodie_errno(outfilename);
   fprintf(fout, "-----BEGIN PGP SIGNED MESSAGE-----\nHash: %s\n\n", hname);
-  while (first || (l = read(fd, cbuf + have, cbufl - have)) > 0 || (l == 0 && have))
+  /* lines are taken directly from the read data, only a line that
+   * crosses a chunk boundary is collected in cbuf */
+  for (; l > 0; l = stream_read(st, &buf))
     {
-      first = 0;
-      if (nl)
-	hash_write(ctx, (const unsigned char *)"\r\n",  2);
-      nl = 0;
-      l += have;
-      for (i = 0; i < l; i++)
-	if (cbuf[i] == '\n')
-	  break;
-      if (i == l && i == cbufl && l != have)
+      for (p = buf, end = buf + l; (q = memchr(p, '\n', end - p)) != 0; p = q + 1)
 	{
-	  cbufl *= 2;
-	  cbuf = dorealloc(cbuf, cbufl);
-	  have = l;
-	  continue;
+	  if (!have)
+	    {
+	      if (q - p > 20000)
+		dodie("line too long for clearsign");
+	      clearsign_line(fout, ctx, p, q - p, &nl);
+	      continue;
+	    }
+	  if (have + (q - p) > 20000)
+	    dodie("line too long for clearsign");
+	  memcpy(cbuf + have, p, q - p);
+	  clearsign_line(fout, ctx, cbuf, have + (q - p), &nl);
+	  have = 0;
 	}
-      if ((l > 0 && cbuf[0] == '-') || (l > 4 && !strncmp((char *)cbuf, "From ", 5)))
-	fprintf(fout, "- ");
-      if (i == l)
-	{
-	  /* EOF reached, line is unterminated */
-	  cbuf[l] = '\n';
-	  l++;
-	}
-      if (i > 20000)
+      if (p == end)
+	continue;
+      if (have + (end - p) > 20000)
 	dodie("line too long for clearsign");
-      fwrite(cbuf, 1, i + 1, fout);
-      for (j = i - 1; j >= 0; j--)
-	if (cbuf[j] != '\r' && cbuf[j] != ' ' && cbuf[j] != '\t')
-	  break;
-      if (j >= 0)
-	hash_write(ctx, cbuf, j + 1);
-      nl = 1;
-      i++;
-      if (i < l)
-	memmove(cbuf, cbuf + i, l - i);
-      have = l - i;
-    }
-  if (l < 0)
-    {
-      perror("read");
-      if (!isfilter)
-	unlink(outfilename);
-      exit(1);
+      if (!cbuf)
+	cbuf = doalloc(20000);
+      memcpy(cbuf + have, p, end - p);
+      have += end - p;
     }
+  /* an unterminated last line, or an empty file */
+  if (have || !nl)
+    clearsign_line(fout, ctx, cbuf ? cbuf : (const byte *)"", have, &nl);
+  stream_close(st);
   free(cbuf);
   *foutp = fout;
   return 1;
@@ -93,6 +93,106 @@ burn_stack (int bytes)
         burn_stack (bytes);
 }
 
+/*****************************************************************/
+/* cpu feature detection                                         */
+/*****************************************************************/
+
+/* The block transforms are called through function pointers that
+ * start out pointing to a "select" function. On the first call the
+ * best implementation for the running cpu is picked, checked against
+ * a known answer and the portable code, and the pointer is updated.
+ * Setting SIGN_HASH_ACCEL=0 in the environment or calling
+ * hash_set_accel(0) disables all accelerated code paths.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HASH_X86 1
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+# define HASH_ARM64 1
+# include <sys/auxv.h>
+# include <arm_neon.h>
+# ifndef HWCAP_SHA1
+#  define HWCAP_SHA1 (1 << 5)
+# endif
+# ifndef HWCAP_SHA2
+#  define HWCAP_SHA2 (1 << 6)
+# endif
+# ifdef __clang__
+#  define ARM_CRYPTO_TARGET __attribute__((target("crypto")))
+# else
+#  define ARM_CRYPTO_TARGET __attribute__((target("+crypto")))
+# endif
+#endif
+
+#define HASH_CPU_PROBED		(1 << 0)
+#define HASH_CPU_ACCEL		(1 << 5)	/* accelerated code allowed */
+#define HASH_CPU_SHA1		(1 << 1)	/* x86 SHA-NI or ARMv8 SHA1 */
+#define HASH_CPU_SHA256		(1 << 2)	/* x86 SHA-NI or ARMv8 SHA2 */
+#define HASH_CPU_AVX2		(1 << 3)	/* x86 AVX2 + BMI2 */
+#define HASH_CPU_AVX512		(1 << 4)	/* x86 AVX-512F + AVX-512VL */
+
+static int hash_cpu;
+static int hash_accel = -1;	/* -1: use SIGN_HASH_ACCEL */
+
+static int
+hash_cpu_features(void)
+{
+    const char *accel;
+    int cpu = HASH_CPU_PROBED;
+
+    if (hash_cpu)
+	return hash_cpu;
+    if (hash_accel < 0) {
+	accel = getenv("SIGN_HASH_ACCEL");
+	hash_accel = !accel || strcmp(accel, "0") != 0;
+    }
+    if (hash_accel) {
+	cpu |= HASH_CPU_ACCEL;
+#ifdef HASH_X86
+	unsigned int eax, ebx, ecx, edx, xcr0 = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+	    && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+	    && __get_cpuid_max(0, 0) >= 7) {
+	    /* the ymm/zmm state must be enabled by the kernel */
+	    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+		__asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+	    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+	    if (ebx & (1 << 29))
+		cpu |= HASH_CPU_SHA1 | HASH_CPU_SHA256;
+	    if ((xcr0 & 0x06) == 0x06 && (ebx & (1 << 5)) && (ebx & (1 << 8)))
+		cpu |= HASH_CPU_AVX2;
+	    if ((cpu & HASH_CPU_AVX2) && (xcr0 & 0xe6) == 0xe6
+		&& (ebx & (1 << 16)) && (ebx & (1u << 31)))
+		cpu |= HASH_CPU_AVX512;
+	}
+#endif
+#ifdef HASH_ARM64
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	if (hwcap & HWCAP_SHA1)
+	    cpu |= HASH_CPU_SHA1;
+	if (hwcap & HWCAP_SHA2)
+	    cpu |= HASH_CPU_SHA256;
+#endif
+    }
+    hash_cpu = cpu;
+    return cpu;
+}
+
+/* fill a buffer with a reproducible pattern for the self tests */
+static void
+hash_selftest_pattern(byte *buf, size_t len)
+{
+    u32 x = 0x2545f491;
+    for (; len; len--) {
+	x = x * 1103515245 + 12345;
+	*buf++ = x >> 23;
+    }
+}
+
 void
 sha1_init( SHA1_CONTEXT *hd )
 {
@@ -246,6 +346,161 @@ sha1_transform( SHA1_CONTEXT *hd, const byte *data )
     hd->h4 += e;
 }
 
+static void
+sha1_transform_portable( SHA1_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    for( ; nblks; nblks--, data += 64 )
+	sha1_transform( hd, data );
+}
+
+#ifdef HASH_X86
+/* SHA-1 using the x86 SHA extensions, four rounds per sha1rnds4 */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha1_transform_shani( SHA1_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e1, e0_save, m[4];
+    int g;
+
+    abcd = _mm_set_epi32(hd->h0, hd->h1, hd->h2, hd->h3);
+    e0 = _mm_set_epi32(hd->h4, 0, 0, 0);
+    for( ; nblks; nblks--, data += 64 ) {
+	abcd_save = abcd;
+	e0_save = e0;
+	for( g = 0; g < 4; g++ )
+	    m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+	/* fully unrolled so that the round constants are immediates */
+#pragma GCC unroll 20
+	for( g = 0; g < 20; g++ ) {
+	    /* e0 holds E for even groups, e1 for odd ones */
+	    __m128i *ecur = (g & 1) ? &e1 : &e0;
+	    if( g == 0 )
+		*ecur = _mm_add_epi32(*ecur, m[0]);
+	    else
+		*ecur = _mm_sha1nexte_epu32(*ecur, m[g & 3]);
+	    if( g & 1 )
+		e0 = abcd;
+	    else
+		e1 = abcd;
+	    if( g >= 3 && g <= 18 )
+		m[(g + 1) & 3] = _mm_sha1msg2_epu32(m[(g + 1) & 3], m[g & 3]);
+	    switch( g / 5 ) {
+	      case 0: abcd = _mm_sha1rnds4_epu32(abcd, *ecur, 0); break;
+	      case 1: abcd = _mm_sha1rnds4_epu32(abcd, *ecur, 1); break;
+	      case 2: abcd = _mm_sha1rnds4_epu32(abcd, *ecur, 2); break;
+	      default: abcd = _mm_sha1rnds4_epu32(abcd, *ecur, 3); break;
+	    }
+	    if( g >= 1 && g <= 16 )
+		m[(g + 3) & 3] = _mm_sha1msg1_epu32(m[(g + 3) & 3], m[g & 3]);
+	    if( g >= 2 && g <= 17 )
+		m[(g + 2) & 3] = _mm_xor_si128(m[(g + 2) & 3], m[g & 3]);
+	}
+	/* group 19 left E for the next block in e0 */
+	e0 = _mm_sha1nexte_epu32(e0, e0_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    hd->h0 = _mm_extract_epi32(abcd, 3);
+    hd->h1 = _mm_extract_epi32(abcd, 2);
+    hd->h2 = _mm_extract_epi32(abcd, 1);
+    hd->h3 = _mm_extract_epi32(abcd, 0);
+    hd->h4 = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+#ifdef HASH_ARM64
+/* SHA-1 using the ARMv8 crypto extensions */
+ARM_CRYPTO_TARGET
+static void
+sha1_transform_arm( SHA1_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    static const u32 kv[4] = { K1, K2, K3, K4 };
+    uint32x4_t abcd, abcd_save, m[4], tmp;
+    u32 e, e1, e_save;
+    int g;
+
+    abcd = vld1q_u32(&hd->h0);
+    e = hd->h4;
+    for( ; nblks; nblks--, data += 64 ) {
+	abcd_save = abcd;
+	e_save = e;
+	for( g = 0; g < 4; g++ )
+	    m[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+#pragma GCC unroll 20
+	for( g = 0; g < 20; g++ ) {
+	    if( g >= 4 )
+		m[g & 3] = vsha1su1q_u32(vsha1su0q_u32(m[g & 3], m[(g + 1) & 3], m[(g + 2) & 3]), m[(g + 3) & 3]);
+	    tmp = vaddq_u32(m[g & 3], vdupq_n_u32(kv[g / 5]));
+	    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+	    if( g < 5 )
+		abcd = vsha1cq_u32(abcd, e, tmp);
+	    else if( g >= 10 && g < 15 )
+		abcd = vsha1mq_u32(abcd, e, tmp);
+	    else
+		abcd = vsha1pq_u32(abcd, e, tmp);
+	    e = e1;
+	}
+	abcd = vaddq_u32(abcd, abcd_save);
+	e += e_save;
+    }
+    vst1q_u32(&hd->h0, abcd);
+    hd->h4 = e;
+}
+#endif
+
+static void sha1_transform_select( SHA1_CONTEXT *hd, const byte *data, size_t nblks );
+static void (*sha1_transform_blocks)( SHA1_CONTEXT *hd, const byte *data, size_t nblks ) = sha1_transform_select;
+
+/* check an accelerated transform against a known answer and against
+ * the portable code before trusting it */
+static int
+sha1_transform_check( void (*fn)( SHA1_CONTEXT *, const byte *, size_t ) )
+{
+    static const u32 abc[5] = {
+	0xa9993e36, 0x4706816a, 0xba3e2571, 0x7850c26c, 0x9cd0d89d
+    };
+    SHA1_CONTEXT c1, c2;
+    byte buf[64 * 5];
+
+    memset(buf, 0, 64);
+    memcpy(buf, "abc\x80", 4);
+    buf[63] = 24;
+    sha1_init(&c1);
+    fn(&c1, buf, 1);
+    if (c1.h0 != abc[0] || c1.h1 != abc[1] || c1.h2 != abc[2] || c1.h3 != abc[3] || c1.h4 != abc[4])
+	return 0;
+    hash_selftest_pattern(buf, sizeof(buf));
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    sha1_init(&c1);
+    sha1_init(&c2);
+    fn(&c1, buf, 5);
+    sha1_transform_portable(&c2, buf, 5);
+    return memcmp(&c1, &c2, sizeof(c1)) == 0;
+}
+
+static void
+sha1_transform_select( SHA1_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    void (*fn)( SHA1_CONTEXT *, const byte *, size_t ) = 0;
+    int cpu = hash_cpu_features();
+
+#ifdef HASH_X86
+    if (cpu & HASH_CPU_SHA1)
+	fn = sha1_transform_shani;
+#endif
+#ifdef HASH_ARM64
+    if (cpu & HASH_CPU_SHA1)
+	fn = sha1_transform_arm;
+#endif
+    if (fn && !sha1_transform_check(fn)) {
+	fprintf(stderr, "sha1: accelerated transform failed self test, using portable code\n");
+	fn = 0;
+    }
+    sha1_transform_blocks = fn ? fn : sha1_transform_portable;
+    sha1_transform_blocks(hd, data, nblks);
+}
+
 
 /* Update the message digest with the contents
  * of INBUF with length INLEN.
@@ -254,7 +509,7 @@ void
 sha1_write( SHA1_CONTEXT *hd, const byte *inbuf, size_t inlen)
 {
     if( hd->count == 64 ) { /* flush the buffer */
-	sha1_transform( hd, hd->buf );
+	sha1_transform_blocks( hd, hd->buf, 1 );
         burn_stack (88+4*sizeof(void*));
 	hd->count = 0;
 	hd->nblocks++;
@@ -269,12 +524,12 @@ sha1_write( SHA1_CONTEXT *hd, const byte *inbuf, size_t inlen)
 	    return;
     }
 
-    while( inlen >= 64 ) {
-	sha1_transform( hd, inbuf );
+    if( inlen >= 64 ) {
+	sha1_transform_blocks( hd, inbuf, inlen / 64 );
 	hd->count = 0;
-	hd->nblocks++;
-	inlen -= 64;
-	inbuf += 64;
+	hd->nblocks += inlen / 64;
+	inbuf += inlen & ~(size_t)63;
+	inlen &= 63;
     }
     burn_stack (88+4*sizeof(void*));
     for( ; inlen && hd->count < 64; inlen-- )
@@ -332,7 +587,7 @@ sha1_final(SHA1_CONTEXT *hd)
     hd->buf[61] = lsb >> 16;
     hd->buf[62] = lsb >>  8;
     hd->buf[63] = lsb	   ;
-    sha1_transform( hd, hd->buf );
+    sha1_transform_blocks( hd, hd->buf, 1 );
     burn_stack (88+4*sizeof(void*));
 
     p = hd->buf;
@@ -377,6 +632,21 @@ sha256_init( SHA256_CONTEXT *hd )
     hd->count = 0;
 }
 
+static const u32 sha256_k[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
 /****************
  * Transform the message w which consists of 16 32-bit words
  */
@@ -386,20 +656,6 @@ sha256_transform( SHA256_CONTEXT *hd, const byte *data )
   u32 a,b,c,d,e,f,g,h;
   u32 w[64];
   int t;
-  static const u32 k[]=
-    {
-      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
-      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
-      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
-      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
-      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
-      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
-      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
-      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
 
   /* get values from the chaining vars */
   a = hd->h0;
@@ -443,7 +699,7 @@ sha256_transform( SHA256_CONTEXT *hd, const byte *data )
     {
       u32 t1,t2;
 
-      t1=h+Sum1(e)+Ch(e,f,g)+k[t]+w[t];
+      t1=h+Sum1(e)+Ch(e,f,g)+sha256_k[t]+w[t];
       t2=Sum0(a)+Maj(a,b,c);
       h=g;
       g=f;
@@ -475,6 +731,155 @@ sha256_transform( SHA256_CONTEXT *hd, const byte *data )
   hd->h7 += h;
 }
 
+static void
+sha256_transform_portable( SHA256_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    for( ; nblks; nblks--, data += 64 )
+	sha256_transform( hd, data );
+}
+
+#ifdef HASH_X86
+/* SHA-256 using the x86 SHA extensions, two rounds per sha256rnds2 */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha256_transform_shani( SHA256_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, msg, tmp, m[4];
+    int i;
+
+    /* state0 = ABEF, state1 = CDGH */
+    tmp = _mm_set_epi32(hd->h3, hd->h2, hd->h1, hd->h0);
+    state1 = _mm_set_epi32(hd->h7, hd->h6, hd->h5, hd->h4);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for( ; nblks; nblks--, data += 64 ) {
+	save0 = state0;
+	save1 = state1;
+	for( i = 0; i < 4; i++ )
+	    m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+#pragma GCC unroll 16
+	for( i = 0; i < 16; i++ ) {
+	    msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)(sha256_k + 4 * i)));
+	    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	    if( i >= 3 && i <= 14 ) {
+		tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+		m[(i + 1) & 3] = _mm_add_epi32(m[(i + 1) & 3], tmp);
+		m[(i + 1) & 3] = _mm_sha256msg2_epu32(m[(i + 1) & 3], m[i & 3]);
+	    }
+	    msg = _mm_shuffle_epi32(msg, 0x0E);
+	    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	    if( i >= 1 && i <= 12 )
+		m[(i + 3) & 3] = _mm_sha256msg1_epu32(m[(i + 3) & 3], m[i & 3]);
+	}
+	state0 = _mm_add_epi32(state0, save0);
+	state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    hd->h0 = _mm_extract_epi32(state0, 0);
+    hd->h1 = _mm_extract_epi32(state0, 1);
+    hd->h2 = _mm_extract_epi32(state0, 2);
+    hd->h3 = _mm_extract_epi32(state0, 3);
+    hd->h4 = _mm_extract_epi32(state1, 0);
+    hd->h5 = _mm_extract_epi32(state1, 1);
+    hd->h6 = _mm_extract_epi32(state1, 2);
+    hd->h7 = _mm_extract_epi32(state1, 3);
+}
+#endif
+
+#ifdef HASH_ARM64
+/* SHA-256 using the ARMv8 crypto extensions */
+ARM_CRYPTO_TARGET
+static void
+sha256_transform_arm( SHA256_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    uint32x4_t s0, s1, save0, save1, m[4], tmp, t2;
+    int g;
+
+    s0 = vld1q_u32(&hd->h0);
+    s1 = vld1q_u32(&hd->h4);
+    for( ; nblks; nblks--, data += 64 ) {
+	save0 = s0;
+	save1 = s1;
+	for( g = 0; g < 4; g++ )
+	    m[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+#pragma GCC unroll 16
+	for( g = 0; g < 16; g++ ) {
+	    if( g >= 4 )
+		m[g & 3] = vsha256su1q_u32(vsha256su0q_u32(m[g & 3], m[(g + 1) & 3]), m[(g + 2) & 3], m[(g + 3) & 3]);
+	    tmp = vaddq_u32(m[g & 3], vld1q_u32(sha256_k + 4 * g));
+	    t2 = s0;
+	    s0 = vsha256hq_u32(s0, s1, tmp);
+	    s1 = vsha256h2q_u32(s1, t2, tmp);
+	}
+	s0 = vaddq_u32(s0, save0);
+	s1 = vaddq_u32(s1, save1);
+    }
+    vst1q_u32(&hd->h0, s0);
+    vst1q_u32(&hd->h4, s1);
+}
+#endif
+
+static void sha256_transform_select( SHA256_CONTEXT *hd, const byte *data, size_t nblks );
+static void (*sha256_transform_blocks)( SHA256_CONTEXT *hd, const byte *data, size_t nblks ) = sha256_transform_select;
+
+static int
+sha256_transform_check( void (*fn)( SHA256_CONTEXT *, const byte *, size_t ) )
+{
+    static const u32 abc[8] = {
+	0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+	0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad
+    };
+    SHA256_CONTEXT c1, c2;
+    byte buf[64 * 5];
+
+    memset(buf, 0, 64);
+    memcpy(buf, "abc\x80", 4);
+    buf[63] = 24;
+    sha256_init(&c1);
+    fn(&c1, buf, 1);
+    if (c1.h0 != abc[0] || c1.h1 != abc[1] || c1.h2 != abc[2] || c1.h3 != abc[3]
+	|| c1.h4 != abc[4] || c1.h5 != abc[5] || c1.h6 != abc[6] || c1.h7 != abc[7])
+	return 0;
+    hash_selftest_pattern(buf, sizeof(buf));
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    sha256_init(&c1);
+    sha256_init(&c2);
+    fn(&c1, buf, 5);
+    sha256_transform_portable(&c2, buf, 5);
+    return memcmp(&c1, &c2, sizeof(c1)) == 0;
+}
+
+static void
+sha256_transform_select( SHA256_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    void (*fn)( SHA256_CONTEXT *, const byte *, size_t ) = 0;
+    int cpu = hash_cpu_features();
+
+#ifdef HASH_X86
+    if (cpu & HASH_CPU_SHA256)
+	fn = sha256_transform_shani;
+#endif
+#ifdef HASH_ARM64
+    if (cpu & HASH_CPU_SHA256)
+	fn = sha256_transform_arm;
+#endif
+    if (fn && !sha256_transform_check(fn)) {
+	fprintf(stderr, "sha256: accelerated transform failed self test, using portable code\n");
+	fn = 0;
+    }
+    sha256_transform_blocks = fn ? fn : sha256_transform_portable;
+    sha256_transform_blocks(hd, data, nblks);
+}
+
 /* Update the message digest with the contents
  * of INBUF with length INLEN.
  */
@@ -482,7 +887,7 @@ void
 sha256_write( SHA256_CONTEXT *hd, const byte *inbuf, size_t inlen)
 {
     if( hd->count == 64 ) { /* flush the buffer */
-        sha256_transform( hd, hd->buf );
+        sha256_transform_blocks( hd, hd->buf, 1 );
         burn_stack (328);
         hd->count = 0;
         hd->nblocks++;
@@ -497,12 +902,12 @@ sha256_write( SHA256_CONTEXT *hd, const byte *inbuf, size_t inlen)
             return;
     }
 
-    while( inlen >= 64 ) {
-        sha256_transform( hd, inbuf );
+    if( inlen >= 64 ) {
+        sha256_transform_blocks( hd, inbuf, inlen / 64 );
         hd->count = 0;
-        hd->nblocks++;
-        inlen -= 64;
-        inbuf += 64;
+        hd->nblocks += inlen / 64;
+        inbuf += inlen & ~(size_t)63;
+        inlen &= 63;
     }
     burn_stack (328);
     for( ; inlen && hd->count < 64; inlen-- )
@@ -558,7 +963,7 @@ sha256_final(SHA256_CONTEXT *hd)
     hd->buf[61] = lsb >> 16;
     hd->buf[62] = lsb >>  8;
     hd->buf[63] = lsb      ;
-    sha256_transform( hd, hd->buf );
+    sha256_transform_blocks( hd, hd->buf, 1 );
     burn_stack (328);
 
     p = hd->buf;
@@ -605,45 +1010,54 @@ sha512_init( SHA512_CONTEXT *hd )
     hd->count = 0;
 }
 
+static const u64 sha512_k[80] =
+  {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+    0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+    0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+    0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+    0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+    0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+    0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+    0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+    0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+    0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+    0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+  };
+
+#define ROTR(x,n) (((x)>>(n)) | ((x)<<(64-(n))))
+#define Ch(x,y,z) (((x) & (y)) ^ ((~(x)) & (z)))
+#define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define Sum0(x) (ROTR((x),28) ^ ROTR((x),34) ^ ROTR((x),39))
+#define Sum1(x) (ROTR((x),14) ^ ROTR((x),18) ^ ROTR((x),41))
+#define S0(x) (ROTR((x),1) ^ ROTR((x),8) ^ ((x)>>7))
+#define S1(x) (ROTR((x),19) ^ ROTR((x),61) ^ ((x)>>6))
+
 /****************
- * Transform the message w which consists of 16 64-bit words
+ * Run the 80 rounds over a message schedule that already has the
+ * round constants added
  */
-static void
-sha512_transform( SHA512_CONTEXT *hd, const byte *data )
+static inline void
+sha512_rounds( SHA512_CONTEXT *hd, const u64 *wk )
 {
   u64 a,b,c,d,e,f,g,h;
-  u64 w[80];
   int t;
-  static const u64 k[]=
-    {
-      0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
-      0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
-      0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
-      0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
-      0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
-      0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
-      0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
-      0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
-      0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
-      0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
-      0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
-      0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
-      0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
-      0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
-      0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
-      0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
-      0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
-      0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
-      0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
-      0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
-      0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
-      0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
-      0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
-      0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
-      0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
-      0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
-      0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
-    };
 
   /* get values from the chaining vars */
   a = hd->h0;
@@ -655,6 +1069,43 @@ sha512_transform( SHA512_CONTEXT *hd, const byte *data )
   g = hd->h6;
   h = hd->h7;
 
+  for(t=0;t<80;t++)
+    {
+      u64 t1,t2;
+
+      t1=h+Sum1(e)+Ch(e,f,g)+wk[t];
+      t2=Sum0(a)+Maj(a,b,c);
+      h=g;
+      g=f;
+      f=e;
+      e=d+t1;
+      d=c;
+      c=b;
+      b=a;
+      a=t1+t2;
+      /* printf("t=%d a=%016llX b=%016llX c=%016llX d=%016llX e=%016llX f=%016llX g=%016llX h=%016llX\n",t,a,b,c,d,e,f,g,h); */
+    }
+
+  /* update chaining vars */
+  hd->h0 += a;
+  hd->h1 += b;
+  hd->h2 += c;
+  hd->h3 += d;
+  hd->h4 += e;
+  hd->h5 += f;
+  hd->h6 += g;
+  hd->h7 += h;
+}
+
+/****************
+ * Transform the message w which consists of 16 64-bit words
+ */
+static void
+sha512_transform( SHA512_CONTEXT *hd, const byte *data )
+{
+  u64 w[80];
+  int t;
+
 #ifdef BIG_ENDIAN_HOST
   memcpy( w, data, 128 );
 #else
@@ -676,33 +1127,12 @@ sha512_transform( SHA512_CONTEXT *hd, const byte *data )
   }
 #endif
 
-#define ROTR(x,n) (((x)>>(n)) | ((x)<<(64-(n))))
-#define Ch(x,y,z) (((x) & (y)) ^ ((~(x)) & (z)))
-#define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
-#define Sum0(x) (ROTR((x),28) ^ ROTR((x),34) ^ ROTR((x),39))
-#define Sum1(x) (ROTR((x),14) ^ ROTR((x),18) ^ ROTR((x),41))
-#define S0(x) (ROTR((x),1) ^ ROTR((x),8) ^ ((x)>>7))
-#define S1(x) (ROTR((x),19) ^ ROTR((x),61) ^ ((x)>>6))
-
   for(t=16;t<80;t++)
     w[t] = S1(w[t-2]) + w[t-7] + S0(w[t-15]) + w[t-16];
-
   for(t=0;t<80;t++)
-    {
-      u64 t1,t2;
-
-      t1=h+Sum1(e)+Ch(e,f,g)+k[t]+w[t];
-      t2=Sum0(a)+Maj(a,b,c);
-      h=g;
-      g=f;
-      f=e;
-      e=d+t1;
-      d=c;
-      c=b;
-      b=a;
-      a=t1+t2;
-      /* printf("t=%d a=%016llX b=%016llX c=%016llX d=%016llX e=%016llX f=%016llX g=%016llX h=%016llX\n",t,a,b,c,d,e,f,g,h); */
-    }
+    w[t] += sha512_k[t];
+  sha512_rounds( hd, w );
+}
 
 #undef ROTR
 #undef Ch
@@ -712,15 +1142,125 @@ sha512_transform( SHA512_CONTEXT *hd, const byte *data )
 #undef S0
 #undef S1
 
-  /* update chaining vars */
-  hd->h0 += a;
-  hd->h1 += b;
-  hd->h2 += c;
-  hd->h3 += d;
-  hd->h4 += e;
-  hd->h5 += f;
-  hd->h6 += g;
-  hd->h7 += h;
+static void
+sha512_transform_portable( SHA512_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    for( ; nblks; nblks--, data += 128 )
+	sha512_transform( hd, data );
+}
+
+#ifdef HASH_X86
+/* The sha512 rounds are inherently serial, but the message schedule
+ * is not: expand the schedules of two blocks at once, one block per
+ * 128 bit lane, then run the scalar rounds (built with bmi2 so the
+ * rotates become rorx) over the precomputed w+k values.
+ * SHA512_SCHEDULE2 is instantiated once with plain AVX2 shifts and
+ * once with the AVX-512VL rotate instruction.
+ */
+#define SHA512_AVX2_ROR(x,n) _mm256_or_si256(_mm256_srli_epi64((x),(n)), _mm256_slli_epi64((x),64-(n)))
+#define SHA512_AVX512_ROR(x,n) _mm256_ror_epi64((x),(n))
+
+#define SHA512_SCHEDULE2(name, isa, ROR)					\
+__attribute__((target(isa)))								\
+static void									\
+name( SHA512_CONTEXT *hd, const byte *data, size_t nblks )			\
+{										\
+    const __m256i bswap = _mm256_set_epi64x(0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL,	\
+					    0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL);	\
+    __m256i x[40], s0, s1, w7, w15;						\
+    u64 wk[2][80] __attribute__((aligned(32)));					\
+    const byte *d2;								\
+    int j;									\
+										\
+    for( ; nblks; nblks -= nblks > 1 ? 2 : 1, data += 256 ) {			\
+	/* an odd last block is simply expanded twice */			\
+	d2 = nblks > 1 ? data + 128 : data;					\
+	for( j = 0; j < 8; j++ ) {						\
+	    x[j] = _mm256_loadu2_m128i((const __m128i *)(d2 + 16 * j),		\
+				       (const __m128i *)(data + 16 * j));	\
+	    x[j] = _mm256_shuffle_epi8(x[j], bswap);				\
+	}									\
+	for( j = 8; j < 40; j++ ) {						\
+	    w15 = _mm256_alignr_epi8(x[j - 7], x[j - 8], 8);			\
+	    w7 = _mm256_alignr_epi8(x[j - 3], x[j - 4], 8);			\
+	    s0 = _mm256_xor_si256(_mm256_xor_si256(ROR(w15, 1), ROR(w15, 8)),	\
+				  _mm256_srli_epi64(w15, 7));			\
+	    s1 = _mm256_xor_si256(_mm256_xor_si256(ROR(x[j - 1], 19), ROR(x[j - 1], 61)), \
+				  _mm256_srli_epi64(x[j - 1], 6));		\
+	    x[j] = _mm256_add_epi64(_mm256_add_epi64(s1, w7),			\
+				    _mm256_add_epi64(s0, x[j - 8]));		\
+	}									\
+	for( j = 0; j < 40; j++ ) {						\
+	    __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(sha512_k + 2 * j))); \
+	    __m256i v = _mm256_add_epi64(x[j], k);				\
+	    _mm_store_si128((__m128i *)(wk[0] + 2 * j), _mm256_castsi256_si128(v));	\
+	    _mm_store_si128((__m128i *)(wk[1] + 2 * j), _mm256_extracti128_si256(v, 1)); \
+	}									\
+	sha512_rounds( hd, wk[0] );						\
+	if( nblks == 1 )							\
+	    break;								\
+	sha512_rounds( hd, wk[1] );						\
+    }										\
+}
+
+SHA512_SCHEDULE2(sha512_transform_avx2, "avx2,bmi2", SHA512_AVX2_ROR)
+SHA512_SCHEDULE2(sha512_transform_avx512, "avx2,bmi2,avx512f,avx512vl", SHA512_AVX512_ROR)
+
+#undef SHA512_SCHEDULE2
+#undef SHA512_AVX2_ROR
+#undef SHA512_AVX512_ROR
+#endif
+
+static void sha512_transform_select( SHA512_CONTEXT *hd, const byte *data, size_t nblks );
+static void (*sha512_transform_blocks)( SHA512_CONTEXT *hd, const byte *data, size_t nblks ) = sha512_transform_select;
+
+static int
+sha512_transform_check( void (*fn)( SHA512_CONTEXT *, const byte *, size_t ) )
+{
+    static const u64 abc[8] = {
+	0xddaf35a193617abaULL, 0xcc417349ae204131ULL, 0x12e6fa4e89a97ea2ULL, 0x0a9eeee64b55d39aULL,
+	0x2192992a274fc1a8ULL, 0x36ba3c23a3feebbdULL, 0x454d4423643ce80eULL, 0x2a9ac94fa54ca49fULL
+    };
+    SHA512_CONTEXT c1, c2;
+    byte buf[128 * 5];
+
+    memset(buf, 0, 128);
+    memcpy(buf, "abc\x80", 4);
+    buf[127] = 24;
+    sha512_init(&c1);
+    fn(&c1, buf, 1);
+    if (c1.h0 != abc[0] || c1.h1 != abc[1] || c1.h2 != abc[2] || c1.h3 != abc[3]
+	|| c1.h4 != abc[4] || c1.h5 != abc[5] || c1.h6 != abc[6] || c1.h7 != abc[7])
+	return 0;
+    /* an odd number of blocks also exercises the paired path */
+    hash_selftest_pattern(buf, sizeof(buf));
+    memset(&c1, 0, sizeof(c1));
+    memset(&c2, 0, sizeof(c2));
+    sha512_init(&c1);
+    sha512_init(&c2);
+    fn(&c1, buf, 5);
+    sha512_transform_portable(&c2, buf, 5);
+    return memcmp(&c1, &c2, sizeof(c1)) == 0;
+}
+
+static void
+sha512_transform_select( SHA512_CONTEXT *hd, const byte *data, size_t nblks )
+{
+    void (*fn)( SHA512_CONTEXT *, const byte *, size_t ) = 0;
+    int cpu = hash_cpu_features();
+
+#ifdef HASH_X86
+    if (cpu & HASH_CPU_AVX512)
+	fn = sha512_transform_avx512;
+    else if (cpu & HASH_CPU_AVX2)
+	fn = sha512_transform_avx2;
+#endif
+    if (fn && !sha512_transform_check(fn)) {
+	fprintf(stderr, "sha512: accelerated transform failed self test, using portable code\n");
+	fn = 0;
+    }
+    sha512_transform_blocks = fn ? fn : sha512_transform_portable;
+    sha512_transform_blocks(hd, data, nblks);
 }
 
 /* Update the message digest with the contents
@@ -730,7 +1270,7 @@ void
 sha512_write( SHA512_CONTEXT *hd, const byte *inbuf, size_t inlen)
 {
     if( hd->count == 128 ) { /* flush the buffer */
-        sha512_transform( hd, hd->buf );
+        sha512_transform_blocks( hd, hd->buf, 1 );
         burn_stack (768);
         hd->count = 0;
         hd->nblocks++;
@@ -745,12 +1285,12 @@ sha512_write( SHA512_CONTEXT *hd, const byte *inbuf, size_t inlen)
             return;
     }
 
-    while( inlen >= 128 ) {
-        sha512_transform( hd, inbuf );
+    if( inlen >= 128 ) {
+        sha512_transform_blocks( hd, inbuf, inlen / 128 );
         hd->count = 0;
-        hd->nblocks++;
-        inlen -= 128;
-        inbuf += 128;
+        hd->nblocks += inlen / 128;
+        inbuf += inlen & ~(size_t)127;
+        inlen &= 127;
     }
     burn_stack (768);
     for( ; inlen && hd->count < 128; inlen-- )
@@ -816,7 +1356,7 @@ sha512_final(SHA512_CONTEXT *hd)
     hd->buf[126] = lsb >> 8;
     hd->buf[127] = lsb;
 
-    sha512_transform( hd, hd->buf );
+    sha512_transform_blocks( hd, hd->buf, 1 );
     burn_stack (768);
 
     p = hd->buf;
@@ -850,7 +1390,18 @@ sha512_read( SHA512_CONTEXT *hd )
 
 /*****************************************************************/
 
-static void rpmMD5Transform(u32 buf[4], u32 const in[16]);
+/* On little endian hosts the message words can be read straight
+ * from the caller's buffer; md5_word allows unaligned access. */
+#if defined(__GNUC__) && !defined(BIG_ENDIAN_HOST)
+# define MD5_DIRECT 1
+typedef u32 md5_word __attribute__((aligned(1), may_alias));
+#else
+typedef u32 md5_word;
+#endif
+
+static void rpmMD5Transform(u32 buf[4], const md5_word in[16]);
+static void md5_transform_select(u32 buf[4], byte *in, const byte *data, size_t nblks);
+static void (*md5_transform_blocks)(u32 buf[4], byte *in, const byte *data, size_t nblks) = md5_transform_select;
 
 #ifdef BIG_ENDIAN_HOST
 static void byteReverse(unsigned char *buf, unsigned longs)
@@ -905,14 +1456,10 @@ void md5_write(struct MD5Context *ctx, byte const *buf, u32 len)
         buf += t;
         len -= t;
     }
-    while (len >= 64) {
-        memcpy(ctx->in, buf, 64);
-#ifdef BIG_ENDIAN_HOST
-	byteReverse(ctx->in, 16);
-#endif
-        rpmMD5Transform(ctx->buf, (u32 *) ctx->in);
-        buf += 64;
-        len -= 64;
+    if (len >= 64) {
+        md5_transform_blocks(ctx->buf, ctx->in, buf, len / 64);
+        buf += len & ~63;
+        len &= 63;
     }
     memcpy(ctx->in, buf, len);
 }
@@ -980,12 +1527,17 @@ void md5_final(byte *digest, struct MD5Context *ctx)
 #define MD5STEP(f, w, x, y, z, data, s) \
         ( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
 
+/* round 2 step: the two halves of F2 are disjoint, so they can be
+ * added separately, shortening the dependency chain on z */
+#define MD5STEP2(f, w, x, y, z, data, s) \
+        ( w += data + (~z & y),  w += z & x,  w = w<<s | w>>(32-s),  w += x )
+
 /*
  * The core of the MD5 algorithm, this alters an existing MD5 hash to
  * reflect the addition of 16 longwords of new data.  md5_write blocks
  * the data and converts bytes into longwords for this routine.
  */
-static void rpmMD5Transform(u32 buf[4], u32 const in[16])
+static void rpmMD5Transform(u32 buf[4], const md5_word in[16])
 {
     register u32 a, b, c, d;
 
@@ -1011,22 +1563,22 @@ static void rpmMD5Transform(u32 buf[4], u32 const in[16])
     MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
     MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
 
-    MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-    MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-    MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-    MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-    MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-    MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-    MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-    MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-    MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-    MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-    MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-    MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-    MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-    MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-    MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-    MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+    MD5STEP2(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+    MD5STEP2(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+    MD5STEP2(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+    MD5STEP2(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+    MD5STEP2(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+    MD5STEP2(F2, d, a, b, c, in[10] + 0x02441453, 9);
+    MD5STEP2(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+    MD5STEP2(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+    MD5STEP2(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+    MD5STEP2(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+    MD5STEP2(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+    MD5STEP2(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+    MD5STEP2(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+    MD5STEP2(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+    MD5STEP2(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+    MD5STEP2(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
 
     MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
     MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
@@ -1068,56 +1620,429 @@ static void rpmMD5Transform(u32 buf[4], u32 const in[16])
     buf[3] += d;
 }
 
+/* process whole blocks by copying them into the context buffer */
+static void md5_transform_copy(u32 buf[4], byte *in, const byte *data, size_t nblks)
+{
+    for (; nblks; nblks--, data += 64) {
+        memcpy(in, data, 64);
+#ifdef BIG_ENDIAN_HOST
+	byteReverse(in, 16);
+#endif
+        rpmMD5Transform(buf, (u32 *) in);
+    }
+}
+
+#ifdef MD5_DIRECT
+/* process whole blocks straight from the caller's buffer */
+static void md5_transform_direct(u32 buf[4], byte *in, const byte *data, size_t nblks)
+{
+    for (; nblks; nblks--, data += 64)
+        rpmMD5Transform(buf, (const md5_word *) data);
+}
+#endif
+
+static void md5_transform_select(u32 buf[4], byte *in, const byte *data, size_t nblks)
+{
+    void (*fn)(u32 *, byte *, const byte *, size_t) = md5_transform_copy;
+
+#ifdef MD5_DIRECT
+    if (hash_cpu_features() & HASH_CPU_ACCEL) {
+	/* compare against the copying code on an unaligned buffer */
+	u32 b1[4] = { 1, 2, 3, 4 }, b2[4] = { 1, 2, 3, 4 };
+	byte pat[64 * 3 + 1], tmp[64];
+	hash_selftest_pattern(pat, sizeof(pat));
+	md5_transform_direct(b1, tmp, pat + 1, 3);
+	md5_transform_copy(b2, tmp, pat + 1, 3);
+	if (memcmp(b1, b2, sizeof(b1)) == 0)
+	    fn = md5_transform_direct;
+	else
+	    fprintf(stderr, "md5: direct transform failed self test, using portable code\n");
+    }
+#endif
+    md5_transform_blocks = fn;
+    md5_transform_blocks(buf, in, data, nblks);
+}
+
+
+/* The hash algorithm is fixed when a context is initialized, all
+ * other calls go straight to the implementation through the ops
+ * table. */
+struct hash_ops {
+  int len;
+  void (*init)(HASH_CONTEXT *c);
+  void (*write)(HASH_CONTEXT *c, const unsigned char *b, size_t l);
+  void (*final)(HASH_CONTEXT *c);
+  unsigned char *(*read)(HASH_CONTEXT *c);
+};
+
+#define HASH_OPS(name, l)							\
+static void name##_hinit(HASH_CONTEXT *c) { name##_init(&c->name); }		\
+static void name##_hwrite(HASH_CONTEXT *c, const unsigned char *b, size_t len) { name##_write(&c->name, b, len); } \
+static void name##_hfinal(HASH_CONTEXT *c) { name##_final(&c->name); }		\
+static unsigned char *name##_hread(HASH_CONTEXT *c) { return name##_read(&c->name); } \
+static const struct hash_ops name##_ops = { l, name##_hinit, name##_hwrite, name##_hfinal, name##_hread };
+
+HASH_OPS(sha1, 20)
+HASH_OPS(sha256, 32)
+HASH_OPS(sha512, 64)
+
+#undef HASH_OPS
+
+static const struct hash_ops *hash_ops[] = { &sha1_ops, &sha256_ops, &sha512_ops };
+
+void hash_init_algo(HASH_CONTEXT *c, int algo)
+{
+  if (algo < HASH_SHA1 || algo > HASH_SHA512)
+    {
+      fprintf(stderr, "unsupported hash algorithm %d\n", algo);
+      exit(1);
+    }
+  c->algo = algo;
+  c->ops = hash_ops[algo];
+  c->ops->init(c);
+}
 
 void hash_init(HASH_CONTEXT *c)
 {
-  if (hashalgo == HASH_SHA1)
-    sha1_init(&c->sha1);
-  else if (hashalgo == HASH_SHA256)
-    sha256_init(&c->sha256);
-  else if (hashalgo == HASH_SHA512)
-    sha512_init(&c->sha512);
+  hash_init_algo(c, hashalgo);
 }
 
 void hash_write(HASH_CONTEXT *c, const unsigned char *b, size_t l)
 {
-  if (hashalgo == HASH_SHA1)
-    sha1_write(&c->sha1, b, l);
-  else if (hashalgo == HASH_SHA256)
-    sha256_write(&c->sha256, b, l);
-  else if (hashalgo == HASH_SHA512)
-    sha512_write(&c->sha512, b, l);
+  c->ops->write(c, b, l);
 }
 
 void hash_final(HASH_CONTEXT *c)
 {
-  if (hashalgo == HASH_SHA1)
-    sha1_final(&c->sha1);
-  else if (hashalgo == HASH_SHA256)
-    sha256_final(&c->sha256);
-  else if (hashalgo == HASH_SHA512)
-    sha512_final(&c->sha512);
+  c->ops->final(c);
 }
 
 unsigned char *hash_read(HASH_CONTEXT *c)
 {
-  if (hashalgo == HASH_SHA1)
-    return sha1_read(&c->sha1);
-  else if (hashalgo == HASH_SHA256)
-    return sha256_read(&c->sha256);
-  else if (hashalgo == HASH_SHA512)
-    return sha512_read(&c->sha512);
-  return 0;
+  return c->ops->read(c);
+}
+
+int hash_algo_len(int algo)
+{
+  return algo >= HASH_SHA1 && algo <= HASH_SHA512 ? hash_ops[algo]->len : 0;
 }
 
+/* digest length of the default hash algorithm */
 int hash_len()
 {
-  if (hashalgo == HASH_SHA1)
-    return 20;
-  else if (hashalgo == HASH_SHA256)
-    return 32;
-  else if (hashalgo == HASH_SHA512)
-    return 64;
-  return 0;
+  return hash_algo_len(hashalgo);
+}
+
+
+/*****************************************************************/
+/* multi-buffer hashing                                          */
+/*****************************************************************/
+
+/* Many small messages can be hashed faster by running one message
+ * per SIMD lane than by hashing them one after the other. The lane
+ * compression functions below work on a transposed state and message
+ * block: word i of lane l lives at index i * L + l.
+ */
+
+#ifdef HASH_X86
+
+#define MB_ROTR(x,n,bits) (((x) >> (n)) | ((x) << ((bits) - (n))))
+#define MB_SHA256_SUM0(x) (MB_ROTR(x,2,32) ^ MB_ROTR(x,13,32) ^ MB_ROTR(x,22,32))
+#define MB_SHA256_SUM1(x) (MB_ROTR(x,6,32) ^ MB_ROTR(x,11,32) ^ MB_ROTR(x,25,32))
+#define MB_SHA256_S0(x) (MB_ROTR(x,7,32) ^ MB_ROTR(x,18,32) ^ ((x) >> 3))
+#define MB_SHA256_S1(x) (MB_ROTR(x,17,32) ^ MB_ROTR(x,19,32) ^ ((x) >> 10))
+#define MB_SHA512_SUM0(x) (MB_ROTR(x,28,64) ^ MB_ROTR(x,34,64) ^ MB_ROTR(x,39,64))
+#define MB_SHA512_SUM1(x) (MB_ROTR(x,14,64) ^ MB_ROTR(x,18,64) ^ MB_ROTR(x,41,64))
+#define MB_SHA512_S0(x) (MB_ROTR(x,1,64) ^ MB_ROTR(x,8,64) ^ ((x) >> 7))
+#define MB_SHA512_S1(x) (MB_ROTR(x,19,64) ^ MB_ROTR(x,61,64) ^ ((x) >> 6))
+
+#define MB_COMPRESS(name, isa, word, L, R, ktab, SUM0, SUM1, S0, S1)		\
+__attribute__((target(isa)))							\
+static void									\
+name( void *stp, const void *wp )						\
+{										\
+    typedef word v_t __attribute__((vector_size(sizeof(word) * L)));	\
+    word *st = stp;								\
+    const word *win = wp;							\
+    v_t s[8], w[16], a, b, c, d, e, f, g, h, t1, t2;				\
+    int t;									\
+										\
+    for( t = 0; t < 8; t++ )							\
+	memcpy(&s[t], st + t * L, sizeof(v_t));					\
+    for( t = 0; t < 16; t++ )							\
+	memcpy(&w[t], win + t * L, sizeof(v_t));				\
+    a = s[0]; b = s[1]; c = s[2]; d = s[3];					\
+    e = s[4]; f = s[5]; g = s[6]; h = s[7];					\
+    _Pragma("GCC unroll 16")							\
+    for( t = 0; t < R; t++ ) {							\
+	if( t >= 16 )								\
+	    w[t & 15] += S1(w[(t - 2) & 15]) + w[(t - 7) & 15] + S0(w[(t - 15) & 15]); \
+	t1 = h + SUM1(e) + (g ^ (e & (f ^ g))) + ktab[t] + w[t & 15];		\
+	t2 = SUM0(a) + ((a & b) | (c & (a | b)));				\
+	h = g; g = f; f = e; e = d + t1;					\
+	d = c; c = b; b = a; a = t1 + t2;					\
+    }										\
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;					\
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;					\
+    for( t = 0; t < 8; t++ )							\
+	memcpy(st + t * L, &s[t], sizeof(v_t));					\
+}
+
+MB_COMPRESS(sha256_x8_avx2, "avx2", u32, 8, 64, sha256_k,
+	    MB_SHA256_SUM0, MB_SHA256_SUM1, MB_SHA256_S0, MB_SHA256_S1)
+MB_COMPRESS(sha256_x16_avx512, "avx512f", u32, 16, 64, sha256_k,
+	    MB_SHA256_SUM0, MB_SHA256_SUM1, MB_SHA256_S0, MB_SHA256_S1)
+MB_COMPRESS(sha512_x4_avx2, "avx2", u64, 4, 80, sha512_k,
+	    MB_SHA512_SUM0, MB_SHA512_SUM1, MB_SHA512_S0, MB_SHA512_S1)
+MB_COMPRESS(sha512_x8_avx512, "avx512f", u64, 8, 80, sha512_k,
+	    MB_SHA512_SUM0, MB_SHA512_SUM1, MB_SHA512_S0, MB_SHA512_S1)
+
+#undef MB_COMPRESS
+#undef MB_ROTR
+#undef MB_SHA256_SUM0
+#undef MB_SHA256_SUM1
+#undef MB_SHA256_S0
+#undef MB_SHA256_S1
+#undef MB_SHA512_SUM0
+#undef MB_SHA512_SUM1
+#undef MB_SHA512_S0
+#undef MB_SHA512_S1
+
+#endif
+
+#define MB_MAXLANES	16
+
+struct mb_engine {
+    int lanes;
+    int ws;		/* word size, 4 or 8 */
+    void (*compress)(void *st, const void *w);
+};
+
+struct mb_lane {
+    int job;		/* message index, -1 if idle */
+    const byte *p;	/* next full data block */
+    size_t full;	/* number of full data blocks left */
+    int ntail;		/* number of padding blocks left */
+    int tailoff;
+    byte tail[256];
+};
+
+static void
+mb_lane_start(struct mb_lane *ln, const struct mb_engine *mb, int job, const byte *data, size_t len, void *st, int l)
+{
+    static const u32 iv256[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    static const u64 iv512[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+    };
+    int bs = 16 * mb->ws;
+    size_t rem = len % bs;
+    u64 bits = (u64)len << 3;
+    int i, tl;
+
+    ln->job = job;
+    ln->p = data;
+    ln->full = len / bs;
+    /* build the padding blocks: data rest, 0x80, zeros, bit count */
+    tl = rem + 1 + 2 * mb->ws <= bs ? bs : 2 * bs;
+    memset(ln->tail, 0, tl);
+    if (rem)
+	memcpy(ln->tail, data + len - rem, rem);
+    ln->tail[rem] = 0x80;
+    for (i = 0; i < 8; i++)
+	ln->tail[tl - 1 - i] = bits >> (8 * i);
+    ln->ntail = tl / bs;
+    ln->tailoff = 0;
+    for (i = 0; i < 8; i++) {
+	if (mb->ws == 4)
+	    ((u32 *)st)[i * mb->lanes + l] = iv256[i];
+	else
+	    ((u64 *)st)[i * mb->lanes + l] = iv512[i];
+    }
+}
+
+static void
+mb_run(const struct mb_engine *mb, int n, const byte **data, const size_t *len, byte **dig)
+{
+    u64 st[8 * MB_MAXLANES], w[16 * MB_MAXLANES];
+    struct mb_lane *lanes, *ln;
+    int L = mb->lanes, ws = mb->ws;
+    int next = 0, active = 0;
+    int i, l;
+
+    lanes = doalloc(L * sizeof(*lanes));
+    memset(w, 0, sizeof(w));
+    for (l = 0; l < L; l++) {
+	lanes[l].job = -1;
+	if (next < n) {
+	    mb_lane_start(lanes + l, mb, next, data[next], len[next], st, l);
+	    next++;
+	    active++;
+	}
+    }
+    while (active) {
+	/* transpose the next block of every lane into w */
+	for (l = 0, ln = lanes; l < L; l++, ln++) {
+	    const byte *bp;
+	    if (ln->job < 0)
+		continue;
+	    if (ln->full) {
+		bp = ln->p;
+		ln->p += 16 * ws;
+		ln->full--;
+	    } else {
+		bp = ln->tail + ln->tailoff;
+		ln->tailoff += 16 * ws;
+		ln->ntail--;
+	    }
+	    for (i = 0; i < 16; i++, bp += ws) {
+		if (ws == 4)
+		    ((u32 *)w)[i * L + l] = (u32)bp[0] << 24 | bp[1] << 16 | bp[2] << 8 | bp[3];
+		else
+		    ((u64 *)w)[i * L + l] = (u64)bp[0] << 56 | (u64)bp[1] << 48 | (u64)bp[2] << 40 | (u64)bp[3] << 32 |
+					   (u64)bp[4] << 24 | bp[5] << 16 | bp[6] << 8 | bp[7];
+	    }
+	}
+	mb->compress(st, w);
+	/* emit finished lanes and refill them */
+	for (l = 0, ln = lanes; l < L; l++, ln++) {
+	    byte *dp;
+	    if (ln->job < 0 || ln->full || ln->ntail)
+		continue;
+	    dp = dig[ln->job];
+	    for (i = 0; i < 8; i++) {
+		if (ws == 4) {
+		    u32 x = ((u32 *)st)[i * L + l];
+		    *dp++ = x >> 24; *dp++ = x >> 16; *dp++ = x >> 8; *dp++ = x;
+		} else {
+		    u64 x = ((u64 *)st)[i * L + l];
+		    int j;
+		    for (j = 56; j >= 0; j -= 8)
+			*dp++ = x >> j;
+		}
+	    }
+	    ln->job = -1;
+	    active--;
+	    if (next < n) {
+		mb_lane_start(ln, mb, next, data[next], len[next], st, l);
+		next++;
+		active++;
+	    }
+	}
+    }
+    free(lanes);
+}
+
+static void
+hash_multi_scalar(int algo, int n, const byte **data, const size_t *len, byte **dig)
+{
+    HASH_CONTEXT ctx;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	hash_init_algo(&ctx, algo);
+	hash_write(&ctx, data[i], len[i]);
+	hash_final(&ctx);
+	memcpy(dig[i], hash_read(&ctx), hash_algo_len(algo));
+    }
+}
+
+/* compare an engine against the scalar code on messages of all
+ * interesting padding lengths */
+static int
+mb_check(const struct mb_engine *mb, int algo)
+{
+    /* message i starts at buf + i and is at most 40 * 39 bytes long */
+    byte buf[40 + 40 * 39], digs[2][40][64];
+    const byte *data[40];
+    size_t len[40];
+    byte *dig[2][40];
+    int i;
+
+    hash_selftest_pattern(buf, sizeof(buf));
+    memset(digs, 0, sizeof(digs));
+    for (i = 0; i < 40; i++) {
+	data[i] = buf + i;
+	len[i] = i < 20 ? 16 * mb->ws - 10 + i : 40 * i;
+	dig[0][i] = digs[0][i];
+	dig[1][i] = digs[1][i];
+    }
+    mb_run(mb, 40, data, len, dig[0]);
+    hash_multi_scalar(algo, 40, data, len, dig[1]);
+    return memcmp(digs[0], digs[1], sizeof(digs[0])) == 0;
+}
+
+static int mb_probed[3];
+static const struct mb_engine *mb_engine[3];
+
+static const struct mb_engine *
+mb_select(int algo)
+{
+    const struct mb_engine *mb = 0;
+#ifdef HASH_X86
+    static const struct mb_engine mb_sha256_x8 = { 8, 4, sha256_x8_avx2 };
+    static const struct mb_engine mb_sha256_x16 = { 16, 4, sha256_x16_avx512 };
+    static const struct mb_engine mb_sha512_x4 = { 4, 8, sha512_x4_avx2 };
+    static const struct mb_engine mb_sha512_x8 = { 8, 8, sha512_x8_avx512 };
+    int cpu = hash_cpu_features();
+#endif
+
+    if (algo < 0 || algo > 2)
+	return 0;
+    if (mb_probed[algo])
+	return mb_engine[algo];
+#ifdef HASH_X86
+    /* a single SHA-NI stream is at least as fast as 16 sha256 lanes */
+    if (algo == HASH_SHA256 && (cpu & HASH_CPU_SHA256))
+	mb = 0;
+    else if (algo == HASH_SHA256 && (cpu & HASH_CPU_AVX512))
+	mb = &mb_sha256_x16;
+    else if (algo == HASH_SHA256 && (cpu & HASH_CPU_AVX2))
+	mb = &mb_sha256_x8;
+    else if (algo == HASH_SHA512 && (cpu & HASH_CPU_AVX512))
+	mb = &mb_sha512_x8;
+    else if (algo == HASH_SHA512 && (cpu & HASH_CPU_AVX2))
+	mb = &mb_sha512_x4;
+#endif
+    if (mb && !mb_check(mb, algo)) {
+	fprintf(stderr, "hash: multi-buffer code failed self test, using portable code\n");
+	mb = 0;
+    }
+    mb_probed[algo] = 1;
+    mb_engine[algo] = mb;
+    return mb;
+}
+
+/* Hash N complete messages with hash algorithm ALGO. The digest of
+ * message i is written to dig[i], which must have room for
+ * hash_algo_len(algo) bytes.
+ */
+void
+hash_multi(int algo, int n, const unsigned char **data, const size_t *len, unsigned char **dig)
+{
+    const struct mb_engine *mb = n > 1 ? mb_select(algo) : 0;
+
+    if (mb)
+	mb_run(mb, n, data, len, dig);
+    else
+	hash_multi_scalar(algo, n, data, len, dig);
 }
 
+/* Enable or disable the accelerated code paths at runtime. This
+ * overrides SIGN_HASH_ACCEL and makes all transforms reselect their
+ * implementation on the next use.
+ */
+void
+hash_set_accel(int on)
+{
+    hash_accel = on ? 1 : 0;
+    hash_cpu = 0;
+    sha1_transform_blocks = sha1_transform_select;
+    sha256_transform_blocks = sha256_transform_select;
+    sha512_transform_blocks = sha512_transform_select;
+    md5_transform_blocks = md5_transform_select;
+    memset(mb_probed, 0, sizeof(mb_probed));
+}
@@ -0,0 +1,127 @@
+/* Measure the hash implementations with and without the accelerated
+ * code paths. Usage: hashbench [MiB]
+ */
+
+#include <time.h>
+
+#include "inc.h"
+
+int hashalgo = HASH_SHA1;
+
+static const char *hashname[] = { "sha1", "sha256", "sha512" };
+
+#define CHUNK 65536	/* the read size used by sign */
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_md5(const byte *buf, size_t len)
+{
+  MD5_CTX md5;
+  byte digest[16];
+  double t = now();
+  size_t off;
+
+  md5_init(&md5);
+  for (off = 0; off < len; off += CHUNK)
+    md5_write(&md5, buf + off, len - off > CHUNK ? CHUNK : len - off);
+  md5_final(digest, &md5);
+  return now() - t;
+}
+
+static double
+bench_hash(const byte *buf, size_t len)
+{
+  HASH_CONTEXT ctx;
+  double t = now();
+  size_t off;
+
+  hash_init(&ctx);
+  for (off = 0; off < len; off += CHUNK)
+    hash_write(&ctx, buf + off, len - off > CHUNK ? CHUNK : len - off);
+  hash_final(&ctx);
+  return now() - t;
+}
+
+/* the same hashing work as signing an rpm: md5 and the signature
+ * hash while reading, md5 again when writing the result */
+static double
+bench_rpm(const byte *buf, size_t len)
+{
+  MD5_CTX md5, md5b;
+  HASH_CONTEXT ctx;
+  byte digest[16];
+  double t = now();
+  size_t off, chunk;
+
+  md5_init(&md5);
+  hash_init(&ctx);
+  for (off = 0; off < len; off += chunk)
+    {
+      chunk = len - off > CHUNK ? CHUNK : len - off;
+      md5_write(&md5, buf + off, chunk);
+      hash_write(&ctx, buf + off, chunk);
+    }
+  md5_final(digest, &md5);
+  hash_final(&ctx);
+  md5_init(&md5b);
+  for (off = 0; off < len; off += chunk)
+    {
+      chunk = len - off > CHUNK ? CHUNK : len - off;
+      md5_write(&md5b, buf + off, chunk);
+    }
+  md5_final(digest, &md5b);
+  return now() - t;
+}
+
+static void
+report(const char *what, size_t len, double tp, double ta)
+{
+  printf("%-16s %8.1f MB/s %8.1f MB/s   %+6.1f%%\n", what, len / tp / 1e6, len / ta / 1e6, (ta - tp) / tp * 100);
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t len = (argc > 1 ? atoi(argv[1]) : 256) * (size_t)1048576;
+  byte *buf;
+  double tp, ta;
+  char what[32];
+  size_t i;
+
+  buf = doalloc(len);
+  for (i = 0; i < len; i++)
+    buf[i] = i * 2654435761U >> 24;
+  printf("%-16s %13s %13s %9s\n", "", "portable", "accelerated", "time");
+
+  hash_set_accel(0);
+  tp = bench_md5(buf, len);
+  hash_set_accel(1);
+  ta = bench_md5(buf, len);
+  report("md5", len, tp, ta);
+  for (hashalgo = HASH_SHA1; hashalgo <= HASH_SHA512; hashalgo++)
+    {
+      hash_set_accel(0);
+      tp = bench_hash(buf, len);
+      hash_set_accel(1);
+      ta = bench_hash(buf, len);
+      report(hashname[hashalgo], len, tp, ta);
+    }
+  for (hashalgo = HASH_SHA1; hashalgo <= HASH_SHA512; hashalgo++)
+    {
+      hash_set_accel(0);
+      tp = bench_rpm(buf, len);
+      hash_set_accel(1);
+      ta = bench_rpm(buf, len);
+      sprintf(what, "rpm %s", hashname[hashalgo]);
+      report(what, len, tp, ta);
+    }
+  free(buf);
+  return 0;
+}
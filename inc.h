@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 typedef unsigned int u32;
 typedef unsigned long long u64;
@@ -52,10 +53,16 @@ typedef struct MD5Context {
         byte in[64];
 } MD5_CTX;
 
-typedef union {
-  SHA1_CONTEXT sha1;
-  SHA256_CONTEXT sha256;
-  SHA512_CONTEXT sha512;
+struct hash_ops;
+
+typedef struct {
+  const struct hash_ops *ops;	/* set by hash_init */
+  int algo;
+  union {
+    SHA1_CONTEXT sha1;
+    SHA256_CONTEXT sha256;
+    SHA512_CONTEXT sha512;
+  };
 } HASH_CONTEXT;
 
 void sha1_init(SHA1_CONTEXT *hd);
@@ -78,10 +85,14 @@ void md5_write(struct MD5Context *ctx, byte const *buf, u32 len);
 void md5_final(byte *digest, struct MD5Context *ctx);
 
 void hash_init(HASH_CONTEXT *c);
+void hash_init_algo(HASH_CONTEXT *c, int algo);
 void hash_write(HASH_CONTEXT *c, const unsigned char *b, size_t l);
 void hash_final(HASH_CONTEXT *c);
 unsigned char *hash_read(HASH_CONTEXT *c);
 int hash_len(void);
+int hash_algo_len(int algo);
+void hash_multi(int algo, int n, const unsigned char **data, const size_t *len, unsigned char **dig);
+void hash_set_accel(int on);
 
 /* base64.c */
 void printr64(FILE *f, const byte *str, int len);
@@ -149,12 +160,15 @@ struct zip {
   u64 num;
   unsigned char *appended;
   u64 appendedsize;
+  u64 filesize;		/* size of the archive when it was read */
 };
 
 void zip_read(struct zip *zip, int fd);
 void zip_free(struct zip *zip);
 unsigned char *zip_iterentry(struct zip *zip, unsigned char **iterp);
 unsigned char *zip_findentry(struct zip *zip, char *fn);
+int zip_removelast(struct zip *zip, char *fn);
+unsigned char *zip_gettail(struct zip *zip, u64 *lenp);
 
 char *zip_entry_name(unsigned char *entry, int *namel);
 u64 zip_entry_fhpos(unsigned char *entry);
@@ -163,6 +177,7 @@ u32 zip_entry_datetime(unsigned char *entry);
 u64 zip_seekdata(struct zip *zip, int fd, unsigned char *entry);
 void zip_appendfile(struct zip *zip, char *fn, unsigned char *file, u64 filelen, int comp, u32 datetime);
 void zip_write(struct zip *zip, int zipfd, int fd);
+void zip_write_inplace(struct zip *zip, int zipfd, char *filename);
 
 /* rpm.c */
 struct rpmdata {
@@ -173,15 +188,21 @@ struct rpmdata {
   int rpmsigsize;
   byte *rpmsig;         /* signature data (with room for two new signatures) */
 
-  u32 rpmdataoff;	/* header+payload offset in unsigned rpm */
-  u64 hdrin_size;
+  u64 rpmdataoff;	/* header+payload offset in unsigned rpm */
+  u64 hdrin_size;	/* header+payload size from the SIZE or LONGSIZE tag */
   byte *hdrin_md5;      /* points into rpmsig */
   int gotsha1;          /* did we see a RPMSIGTAG_SHA1 tag? */
   int gotsha256;        /* did we see a RPMSIGTAG_SHA256 tag? */
   int gotsigs;		/* is this rpm already signed */
 
   u32 buildtime;
-  byte rpmmd5sum[16];   /* md5sum over header+payload */
+  byte rpmmd5sum[16];   /* md5sum over header+payload (just the header with hdrlen) */
+  u32 hdrlen;		/* header size if only the header was read */
+  struct stat rpmstat;	/* identity of the input when it was read */
+  int leased;		/* we hold a read lease on the input */
+  int spoolfd;		/* copy of header+payload if the input is a pipe */
+  int spoolmem;		/* the spool is a memfd */
+  u64 spoolsize;
 
   byte chksum_leadmd5[16];
   byte chksum_md5[16];
@@ -192,10 +213,29 @@ struct rpmdata {
 
 int rpm_insertsig(struct rpmdata *rd, int hdronly, byte *newsig, int newsiglen);
 int rpm_delsigs(struct rpmdata *rd);
-int rpm_read(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *ctx, HASH_CONTEXT *hctx, int getbuildtime);
-void rpm_write(struct rpmdata *rd, int foutfd, int fd, int chksumfilefd);
+int rpm_read(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *ctx, HASH_CONTEXT *hctx, int getbuildtime, int headeronly, int resign);
+void rpm_write(struct rpmdata *rd, int foutfd, int fd, int chksumfilefd, int digests);
+int rpm_write_inplace(struct rpmdata *rd, int fd, char *filename, int chksumfilefd, int digests);
 void rpm_free(struct rpmdata *rd);
-void rpm_writechecksums(struct rpmdata *rd, int chksumfilefd);
+void rpm_writechecksums(struct rpmdata *rd, int chksumfilefd, int digests);
+
+/* chksum.c */
+#define CHKSUM_MD5	0
+#define CHKSUM_SHA1	1
+#define CHKSUM_SHA256	2
+#define CHKSUM_SHA512	3
+#define CHKSUM_NDIGESTS	4
+#define CHKSUM_ALL	((1 << CHKSUM_NDIGESTS) - 1)
+
+#define CHKSUM_BUFSIZE	65536
+
+struct chksum;
+struct chksum *chksum_start(int digests);
+byte *chksum_getbuf(struct chksum *cs);
+void chksum_putbuf(struct chksum *cs, size_t len);
+void chksum_write(struct chksum *cs, const byte *buf, size_t len);
+void chksum_finish(struct chksum *cs, byte **out);
+int chksum_parse(const char *str);
 
 /* appimage.c */
 int appimage_read(char *filename, HASH_CONTEXT *ctx);
@@ -207,19 +247,29 @@ struct appxdata {
   struct x509 cb_signedattrs;
   struct zip zip;
   u32 datetime;
+  int resigned;		/* the old signature was removed */
 };
 
-int appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx, time_t t);
+int appx_read(struct appxdata *appxdata, int fd, char *filename, HASH_CONTEXT *ctx, time_t t, int resign);
 void appx_write(struct appxdata *appxdata, int outfd, int fd, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts);
+void appx_write_inplace(struct appxdata *appxdata, int fd, char *filename, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts);
 void appx_free(struct appxdata *appxdata);
 
 /* sock.c */
 void opensocket(void);
 void closesocket(void);
+int sockversion(void);
+int sockwantversion(void);
 int doreq_raw(byte *buf, int inbufl, int bufl);
 int doreq_old(const char *user, const char *digest, const char *digestalgo, byte *buf, int bufl);
 int doreq(int argc, const char **argv, byte *buf, int bufl, int nret);
 int doreq_12(int argc, const char **argv, byte *buf, int bufl, int *outl2p);
+int pool_open(int n);
+void pool_close(void);
+int pool_submit(int argc, const char **argv, int nret, void (*done)(void *data, byte *buf, int outl), void *data);
+int pool_pending(void);
+int pool_idle(void);
+void pool_poll(int wakefd);
 
 /* clearsign.c */
 int clearsign(int fd, char *filename, char *outfilename, HASH_CONTEXT *ctx, const char *hname, int isfilter, int force, FILE **foutp);
@@ -235,15 +285,23 @@ struct pedata {
   u32 csum_off;
   u32 filesize;
   u32 csum;
+  int resigned;		/* the old certificate table is dropped */
 };
 
-int pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_t t);
+int pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_t t, int resign);
 void pe_write(struct pedata *pedata, int outfd, int fd, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts);
+int pe_write_inplace(struct pedata *pedata, int fd, char *filename, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts);
 void pe_free(struct pedata *pedata);
 
 /* ko.c */
-int ko_read(int fd, char *filename, HASH_CONTEXT *ctx);
-void ko_write(int outfd, int fd, struct x509 *cb);
+struct kodata {
+  u64 size;		/* size of the module without signature */
+  u64 filesize;		/* size of the file when it was read */
+};
+
+int ko_read(struct kodata *kodata, int fd, char *filename, HASH_CONTEXT *ctx, int resign);
+void ko_write(struct kodata *kodata, int outfd, int fd, struct x509 *cb);
+void ko_write_inplace(struct kodata *kodata, int fd, char *filename, struct x509 *cb);
 
 /* util.c */
 void *doalloc(size_t sz);
@@ -256,6 +314,16 @@ void dowrite(int fd, const unsigned char *buf, size_t len);
 void doseek(int fd, u64 pos);
 u64 doseek_eof(int fd, u64 pos);
 void docopy(int infd, int outfd, u64 len);
+int inplace_open(const char *filename, int fd, int flags);
+void inplace_begin(int fd, const char *filename, u64 off, u64 len);
+void inplace_commit(void);
+void inplace_recover(const char *filename);
+
+#define STREAM_TOEOF ((u64)-1)
+struct stream;
+struct stream *stream_open(int fd, u64 len);
+size_t stream_read(struct stream *st, const unsigned char **bufp);
+void stream_close(struct stream *st);
 
 
 /* cpio.c */
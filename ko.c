@@ -1,10 +1,15 @@
+#include <fcntl.h>
+
 #include "inc.h"
 #include "bele.h"
 
-int ko_read(int fd, char *filename, HASH_CONTEXT *ctx)
+int ko_read(struct kodata *kodata, int fd, char *filename, HASH_CONTEXT *ctx, int resign)
 {
-  u64 length;
-  byte buf[8192];
+  u64 length, siglen;
+  byte buf[40];
+  const byte *data;
+  struct stream *st;
+  size_t chunk;
 
   doread(fd, buf, 4);
   if (buf[0] != 0x7f || buf[1] != 0x45 || buf[2] != 0x4c || buf[3] != 0x46)
@@ -12,32 +17,75 @@ int ko_read(int fd, char *filename, HASH_CONTEXT *ctx)
       fprintf(stderr, "%s: not an ELF binary\n", filename);
       exit(1);
     }
-  length = doseek_eof(fd, 28) + 28;
-  doread(fd, buf, 28);
-  if (!memcmp(buf, "~Module signature appended~\n", 28))
-    return 0;
+  length = doseek_eof(fd, 40) + 40;
+  doread(fd, buf, 40);
+  kodata->filesize = length;
+  if (!memcmp(buf + 12, "~Module signature appended~\n", 28))
+    {
+      if (!resign)
+	return 0;
+      /* strip the old signature: struct module_signature, then the magic */
+      siglen = (u64)buf[3] + buf[4] + getbe4(buf + 8) + 40;
+      if (siglen > length - 4)
+	{
+	  fprintf(stderr, "%s: bad module signature size\n", filename);
+	  exit(1);
+	}
+      length -= siglen;
+    }
+  kodata->size = length;
   doseek(fd, 0);
+  st = stream_open(fd, length);
   while (length > 0)
     {
-      int chunk = length > sizeof(buf) ? sizeof(buf) : (int)length;
-      doread(fd, buf, chunk);
-      hash_write(ctx, buf, chunk);
+      if (!(chunk = stream_read(st, &data)))
+	dodie("unexpeced EOF");
+      hash_write(ctx, data, chunk);
       length -= chunk;
     }
+  stream_close(st);
   return 1;
 }
 
-void
-ko_write(int outfd, int fd, struct x509 *cb)
+static void
+ko_addtrailer(struct x509 *cb)
 {
-  u64 length;
-
   x509_insert(cb, cb->len, 0, 40);
   setbe4(cb->buf + cb->len - 40, 0x00000200);
   setbe4(cb->buf + cb->len - 32, cb->len - 40);
   memcpy(cb->buf + cb->len - 28, "~Module signature appended~\n", 28);
-  length = doseek_eof(fd, 0);
+}
+
+void
+ko_write(struct kodata *kodata, int outfd, int fd, struct x509 *cb)
+{
+  ko_addtrailer(cb);
   doseek(fd, 0);
-  docopy(fd, outfd, length);
+  docopy(fd, outfd, kodata->size);
   dowrite(outfd, cb->buf, cb->len);
 }
+
+/* sign the module in place by appending the signature. The module
+ * is cut back to its old size if something goes wrong. An old
+ * signature is kept in the journal and cut off first. */
+void
+ko_write_inplace(struct kodata *kodata, int fd, char *filename, struct x509 *cb)
+{
+  u64 length;
+  int wfd;
+
+  ko_addtrailer(cb);
+  wfd = inplace_open(filename, fd, O_APPEND);
+  length = doseek_eof(fd, 0);
+  if (length != kodata->filesize)
+    {
+      fprintf(stderr, "%s: file has changed, bailing out!\n", filename);
+      exit(1);
+    }
+  inplace_begin(wfd, filename, kodata->size, length - kodata->size);
+  if (length != kodata->size && ftruncate(wfd, (off_t)kodata->size))
+    dodie_errno("ftruncate");
+  dowrite(wfd, cb->buf, cb->len);
+  inplace_commit();
+  close(wfd);
+}
@@ -26,18 +26,17 @@ update_chksum(u32 pos, const unsigned char *b, int l, u32 *csump)
 static u32
 dohash(int fd, char *filename, u32 pos, u32 l, int toeof, HASH_CONTEXT *ctx, u32 *chkp)
 {
-  unsigned char buf[4096];
+  struct stream *st;
+  const unsigned char *buf;
   u32 hashed = 0;
+  size_t r, i, n;
 
   if (pos >= 0x40000000)
     dodie("unsupported pe file size");
-  if (toeof)
-    l = sizeof(buf);
-  while (l > 0)
+  st = stream_open(fd, toeof ? STREAM_TOEOF : l);
+  while (toeof || l > 0)
     {
-      int r = read(fd, buf, l > sizeof(buf) ? sizeof(buf) : (int)l);
-      if (r < 0)
-	dodie_errno(filename);
+      r = stream_read(st, &buf);
       if (r == 0 && toeof)
 	break;
       if (r == 0)
@@ -45,16 +44,21 @@ dohash(int fd, char *filename, u32 pos, u32 l, int toeof, HASH_CONTEXT *ctx, u32
 	  fprintf(stderr, "%s: unexpexted EOF\n", filename);
 	  exit(1);
 	}
-      if (pos + (u32)r >= 0x40000000)
+      if (pos + r >= 0x40000000)
 	dodie("unsupported pe file size");
       hash_write(ctx, buf, r);
       hashed += r;
-      if (chkp)
-	update_chksum(pos, buf, r, chkp);
+      /* update_chksum can only deal with small pieces */
+      for (i = 0; chkp && i < r; i += n)
+	{
+	  n = r - i > 0x10000 ? 0x10000 : r - i;
+	  update_chksum(pos + i, buf + i, n, chkp);
+	}
       pos += r;
       if (!toeof)
         l -= r;
     }
+  stream_close(st);
   return hashed;
 }
 
@@ -69,7 +73,7 @@ sectioncmp(const void *av, const void *bv)
 }
 
 int
-pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_t t)
+pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_t t, int resign)
 {
   unsigned char hdr[4096];
   HASH_CONTEXT ctx;
@@ -131,8 +135,10 @@ pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_
   if (c_end > c_off && getle4(hdr + stubsize + 24 + c_off + 4) != 0)
     cert_pos = getle4(hdr + stubsize + 24 + c_off);
 
-  if (cert_pos)
+  if (cert_pos && !resign)
     return 0;	/* already signed */
+  /* when re-signing, the old certificate table is dropped */
+  pedata->resigned = cert_pos != 0;
 
   if (c_end == c_off)
     dodie("missing certificate directory entry");
@@ -213,44 +219,89 @@ pe_read(struct pedata *pedata, int fd, char *filename, HASH_CONTEXT *hctx, time_
   return 1;
 }
 
-void
-pe_write(struct pedata *pedata, int outfd, int fd, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
+/* create the certificate table and fix up the header for it */
+static u32
+pe_finish(struct pedata *pedata, struct x509 *cb, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
 {
-  struct x509 cb;
   u32 filesizepad;
 
-  x509_init(&cb);
-  x509_pkcs7_signed_data(&cb, &pedata->cb_content, &pedata->cb_signedattrs, pubalgo, sigcb, cert, othercerts, 0);
+  x509_pkcs7_signed_data(cb, &pedata->cb_content, &pedata->cb_signedattrs, pubalgo, sigcb, cert, othercerts, 0);
 
   /* add cert header and pad */
-  x509_insert(&cb, 0, 0, 8);
-  setle4(cb.buf, cb.len);
-  setle4(cb.buf + 4, 0x00020200);
-  if (cb.len & 7)
-    x509_insert(&cb, cb.len, 0, 8 - (cb.len & 7));
+  x509_insert(cb, 0, 0, 8);
+  setle4(cb->buf, cb->len);
+  setle4(cb->buf + 4, 0x00020200);
+  if (cb->len & 7)
+    x509_insert(cb, cb->len, 0, 8 - (cb->len & 7));
 
   /* now add into certificate directory */
   filesizepad = (8 - (pedata->filesize & 7)) & 7;
   setle4(pedata->hdr + pedata->c_off, pedata->filesize + filesizepad);
-  setle4(pedata->hdr + pedata->c_off + 4, cb.len);
+  setle4(pedata->hdr + pedata->c_off + 4, cb->len);
 
   /* update checksum with header and cert data, put in header */
   setle4(pedata->hdr + pedata->csum_off, 0);
   update_chksum(0, pedata->hdr, pedata->headersize, &pedata->csum);
-  update_chksum(pedata->filesize + filesizepad, cb.buf, cb.len, &pedata->csum);
-  pedata->csum += pedata->filesize + filesizepad + cb.len;
+  update_chksum(pedata->filesize + filesizepad, cb->buf, cb->len, &pedata->csum);
+  pedata->csum += pedata->filesize + filesizepad + cb->len;
   setle4(pedata->hdr + pedata->csum_off, pedata->csum);
+  return filesizepad;
+}
+
+void
+pe_write(struct pedata *pedata, int outfd, int fd, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
+{
+  struct x509 cb;
+  u32 filesizepad;
+
+  x509_init(&cb);
+  filesizepad = pe_finish(pedata, &cb, cert, pubalgo, sigcb, othercerts);
 
   /* write signed pe file */
   dowrite(outfd, pedata->hdr, pedata->headersize);
   doseek(fd, pedata->headersize);
-  docopy(outfd, fd, pedata->filesize - pedata->headersize);
+  docopy(fd, outfd, pedata->filesize - pedata->headersize);
   if (filesizepad)
     dowrite(outfd, (const unsigned char *)"\0\0\0\0\0\0\0\0", filesizepad);
   dowrite(outfd, cb.buf, cb.len);
   x509_free(&cb);
 }
 
+/* sign the image in place: patch the checksum and the certificate
+ * directory entry in the header and append the certificate table.
+ * The body checksum was already computed by pe_read. Returns 0 if
+ * an old certificate table has to be replaced, the image must then
+ * be written to a new file. */
+int
+pe_write_inplace(struct pedata *pedata, int fd, char *filename, struct x509 *cert, int pubalgo, struct x509 *sigcb, struct x509 *othercerts)
+{
+  struct x509 cb;
+  u32 filesizepad;
+  int wfd;
+
+  if (pedata->resigned)
+    return 0;
+  x509_init(&cb);
+  filesizepad = pe_finish(pedata, &cb, cert, pubalgo, sigcb, othercerts);
+  if (filesizepad)
+    x509_insert(&cb, 0, 0, filesizepad);
+  wfd = inplace_open(filename, fd, 0);
+  if (doseek_eof(wfd, 0) != pedata->filesize)
+    {
+      fprintf(stderr, "%s: file has changed, bailing out!\n", filename);
+      exit(1);
+    }
+  inplace_begin(wfd, filename, 0, pedata->headersize);
+  doseek(wfd, 0);
+  dowrite(wfd, pedata->hdr, pedata->headersize);
+  doseek(wfd, pedata->filesize);
+  dowrite(wfd, cb.buf, cb.len);
+  inplace_commit();
+  close(wfd);
+  x509_free(&cb);
+  return 1;
+}
+
 void
 pe_free(struct pedata *pedata)
 {
@@ -17,15 +17,22 @@
  *
  ***************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 
 #include "inc.h"
 #include "bele.h"
 
 #define MAX_SIG_SIZE 1024		/* we pre-allocate space for 2 new signatures */
 
+#define RPM_SPOOL_MEMMAX (64 << 20)	/* spill the spool to disk above this */
+
 #define HEADER_SIGNATURES 62
 #define RPMSIGTAG_DSA   267		/* header only sig */
 #define RPMSIGTAG_RSA   268		/* header only sig */
@@ -40,6 +47,9 @@
 #define RPMSIGTAG_GPG  1005
 #define RPMSIGTAG_RESERVEDSPACE	1008
 
+#define RPMTAG_BUILDTIME 1006
+#define RPMTAG_PAYLOADDIGEST 5092
+
 /* RPM constants */
 static const int  pubtag[]  = { RPMSIGTAG_GPG, RPMSIGTAG_PGP, RPMSIGTAG_GPG, RPMSIGTAG_GPG, 0 };
 static const int  pubtagh[] = { RPMSIGTAG_DSA, RPMSIGTAG_RSA, RPMSIGTAG_DSA, RPMSIGTAG_DSA, 0 };	/* header only tags */
@@ -471,6 +481,7 @@ rpm_readsigheader(struct rpmdata *rd, int fd, const char *filename)
   byte *p, *rsp;
   int i;
   u32 tag;
+  u64 size = 0, longsize = 0;
 
   doread(fd, rd->rpmlead, 96);
   if (getbe4(rd->rpmlead) != 0xedabeedb)
@@ -526,22 +537,197 @@ rpm_readsigheader(struct rpmdata *rd, int fd, const char *filename)
 	      exit(1);
 	    }
 	  p = rd->rpmsig + rd->rpmsigcnt * 16 + o;
-	  rd->hdrin_size = (u32)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+	  size = (u32)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+	}
+      if (tag == RPMSIGTAG_LONGSIZE)
+	{
+          int o = getbe4c(rsp + 8);
+	  if (getbe4(rsp + 4) != 5 || getbe4(rsp + 12) != 1 || o + 8 > rd->rpmsigdlen)
+	    {
+	      fprintf(stderr, "%s: bad LONGSIZE tag\n", filename);
+	      exit(1);
+	    }
+	  p = rd->rpmsig + rd->rpmsigcnt * 16 + o;
+	  longsize = (u64)getbe4(p) << 32 | getbe4(p + 4);
+	  if (!longsize)
+	    {
+	      fprintf(stderr, "%s: bad LONGSIZE tag\n", filename);
+	      exit(1);
+	    }
 	}
     }
+  /* rpms bigger than 4 GiB only have a LONGSIZE tag */
+  if (size && longsize && size != longsize)
+    {
+      fprintf(stderr, "%s: SIZE and LONGSIZE tags do not match\n", filename);
+      exit(1);
+    }
+  rd->hdrin_size = longsize ? longsize : size;
+}
+
+/* A read lease makes the kernel tell us when somebody opens the rpm
+ * for writing or truncates it. As long as we hold it the data cannot
+ * change, so rpm_write can copy the payload without hashing it again.
+ * On a lease break we give the lease up at once so that the writer is
+ * not blocked, and fall back to the md5 check.
+ */
+static int rpm_lease_fd = -1;
+static volatile sig_atomic_t rpm_lease_broken;
+static struct sigaction rpm_lease_oldsa;
+
+static void
+rpm_lease_break(int sig)
+{
+  rpm_lease_broken = 1;
+#ifdef F_SETLEASE
+  if (rpm_lease_fd >= 0)
+    fcntl(rpm_lease_fd, F_SETLEASE, F_UNLCK);
+#endif
+}
+
+static void
+rpm_lease_get(struct rpmdata *rd, int fd)
+{
+  rd->leased = 0;
+  if (fstat(fd, &rd->rpmstat) || !S_ISREG(rd->rpmstat.st_mode))
+    return;
+#ifdef F_SETLEASE
+  {
+    struct sigaction sa;
+    int none = -1;
+    /* only one lease at a time, the other rpms use the md5 check */
+    if (!__atomic_compare_exchange_n(&rpm_lease_fd, &none, fd, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = rpm_lease_break;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGIO, &sa, &rpm_lease_oldsa))
+      {
+	__atomic_store_n(&rpm_lease_fd, -1, __ATOMIC_SEQ_CST);
+	return;
+      }
+    rpm_lease_broken = 0;
+    if (fcntl(fd, F_SETLEASE, F_RDLCK))
+      {
+	/* not our file, open for writing, or not supported */
+	sigaction(SIGIO, &rpm_lease_oldsa, 0);
+	__atomic_store_n(&rpm_lease_fd, -1, __ATOMIC_SEQ_CST);
+	return;
+      }
+    rd->leased = 1;
+  }
+#endif
+}
+
+static void
+rpm_lease_put(struct rpmdata *rd)
+{
+  if (!rd->leased)
+    return;
+#ifdef F_SETLEASE
+  if (!rpm_lease_broken)
+    fcntl(rpm_lease_fd, F_SETLEASE, F_UNLCK);
+  sigaction(SIGIO, &rpm_lease_oldsa, 0);
+  __atomic_store_n(&rpm_lease_fd, -1, __ATOMIC_SEQ_CST);
+#endif
+  rd->leased = 0;
+}
+
+/* check that the input is still the file we have read */
+static int
+rpm_unchanged(struct rpmdata *rd, int fd)
+{
+  struct stat st;
+
+  if (!rd->leased || rpm_lease_broken)
+    return 0;
+  if (fstat(fd, &st))
+    return 0;
+  return st.st_dev == rd->rpmstat.st_dev && st.st_ino == rd->rpmstat.st_ino &&
+	 st.st_size == rd->rpmstat.st_size &&
+	 st.st_mtim.tv_sec == rd->rpmstat.st_mtim.tv_sec && st.st_mtim.tv_nsec == rd->rpmstat.st_mtim.tv_nsec &&
+	 st.st_ctim.tv_sec == rd->rpmstat.st_ctim.tv_sec && st.st_ctim.tv_nsec == rd->rpmstat.st_ctim.tv_nsec;
+}
+
+/* An rpm that comes from a pipe cannot be read twice, so the header
+ * and payload are spooled while we hash them. The spool lives in a
+ * memfd and moves to an unnamed file in $TMPDIR (or /var/tmp) once it
+ * gets big. */
+static int
+rpm_spool_tmpfile(void)
+{
+  const char *dir = getenv("TMPDIR");
+  char *tmpl;
+  int fd;
+
+  if (!dir || !*dir)
+    dir = "/var/tmp";
+#ifdef O_TMPFILE
+  if ((fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600)) >= 0)
+    return fd;
+#endif
+  /* no O_TMPFILE support, unlink the file right away */
+  tmpl = doalloc(strlen(dir) + 16);
+  sprintf(tmpl, "%s/sign.XXXXXX", dir);
+  if ((fd = mkstemp(tmpl)) == -1)
+    dodie_errno(tmpl);
+  unlink(tmpl);
+  free(tmpl);
+  return fd;
+}
+
+static void
+rpm_spool_open(struct rpmdata *rd)
+{
+  rd->spoolsize = 0;
+  rd->spoolfd = -1;
+#ifdef MFD_CLOEXEC
+  rd->spoolfd = memfd_create("sign-rpm", MFD_CLOEXEC);
+#endif
+  rd->spoolmem = rd->spoolfd >= 0;
+  if (rd->spoolfd < 0)
+    rd->spoolfd = rpm_spool_tmpfile();
+}
+
+/* make sure the spool can take len more bytes */
+static void
+rpm_spool_reserve(struct rpmdata *rd, u64 len)
+{
+  if (rd->spoolmem && rd->spoolsize + len > RPM_SPOOL_MEMMAX)
+    {
+      int fd = rpm_spool_tmpfile();
+      doseek(rd->spoolfd, 0);
+      docopy(rd->spoolfd, fd, rd->spoolsize);
+      close(rd->spoolfd);
+      rd->spoolfd = fd;
+      rd->spoolmem = 0;
+    }
+}
+
+static void
+rpm_spool_write(struct rpmdata *rd, const byte *buf, size_t len)
+{
+  rpm_spool_reserve(rd, len);
+  dowrite(rd->spoolfd, buf, len);
+  rd->spoolsize += len;
 }
 
 static void
 rpm_readheaderpayload(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *ctx, HASH_CONTEXT *hctx, int getbuildtime)
 {
-  byte buf[8192];
+  const byte *buf;
   byte btbuf[4];
   MD5_CTX md5ctx;
+  struct stream *st;
   u32 lenhdr;
   u64 lensig;
   int l, i;
   u32 buildtimeoff = 0;
 
+  rpm_lease_get(rd, fd);
+  if (lseek(fd, 0, SEEK_CUR) == (off_t)-1)
+    rpm_spool_open(rd);
   md5_init(&md5ctx);
   if (hctx)
     hash_init(hctx);
@@ -549,11 +735,10 @@ rpm_readheaderpayload(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *
   lensig = 0;
   lenhdr = 0;
   rd->buildtime = 0;
+  st = stream_open(fd, STREAM_TOEOF);
   for (;;)
     {
-      l = read(fd, buf, sizeof(buf));
-      if (l < 0)
-	dodie_errno("read");
+      l = stream_read(st, &buf);
       if (l == 0)
 	break;
       if (!lensig)
@@ -588,6 +773,8 @@ rpm_readheaderpayload(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *
       if (ctx)
         hash_write(ctx, buf,  l);
       md5_write(&md5ctx, buf, l);
+      if (rd->spoolfd >= 0)
+	rpm_spool_write(rd, buf, l);
       if (lenhdr)
 	{
 	  if (l >= lenhdr)
@@ -605,6 +792,7 @@ rpm_readheaderpayload(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *
 	}
       lensig += l;
     }
+  stream_close(st);
   md5_final(rd->rpmmd5sum, &md5ctx);
   if (lenhdr)
     {
@@ -629,37 +817,162 @@ rpm_readheaderpayload(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *
     }
 }
 
+/* Read and hash just the header, the payload is protected by the
+ * payload digest in the header. The SIZE tag tells us where the rpm
+ * ends, so the payload is never read (unless we need to spool it). */
+static void
+rpm_readheader(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *hctx, int getbuildtime)
+{
+  byte intro[16], *hdr;
+  MD5_CTX md5ctx;
+  u32 cnt, dlen, i, o;
+  u64 lenhdr;
+  int gotdigest = 0, gotbuildtime = 0;
+
+  if (!rd->hdrin_size)
+    {
+      fprintf(stderr, "%s: no SIZE tag, cannot do a header only signature\n", filename);
+      exit(1);
+    }
+  rpm_lease_get(rd, fd);
+  doread(fd, intro, 16);
+  if (intro[8] || intro[9] || intro[12] > 0x0f)
+    dodie("header size overflow");
+  cnt = getbe4(intro + 8);
+  dlen = getbe4(intro + 12);
+  lenhdr = 16 + 16 * (u64)cnt + dlen;
+  if (lenhdr > rd->hdrin_size)
+    {
+      fprintf(stderr, "%s: bad header size (%llu)\n", filename, (unsigned long long)lenhdr);
+      exit(1);
+    }
+  hdr = doalloc(lenhdr);
+  memcpy(hdr, intro, 16);
+  doread(fd, hdr + 16, lenhdr - 16);
+  for (i = 0; i < cnt; i++)
+    {
+      byte *e = hdr + 16 + 16 * i;
+      if (getbe4(e) == RPMTAG_PAYLOADDIGEST)
+	gotdigest = 1;
+      if (getbuildtime && getbe4(e) == RPMTAG_BUILDTIME && getbe4(e + 4) == 4)
+	{
+	  o = getbe4(e + 8);
+	  if (dlen < 4 || o > dlen - 4)
+	    dodie("cannot calculate buildtime: bad data pointer");
+	  rd->buildtime = getbe4(hdr + 16 + 16 * cnt + o);
+	  gotbuildtime = 1;
+	}
+    }
+  if (getbuildtime && !gotbuildtime)
+    dodie("cannot calculate buildtime: tag not found");
+  if (!gotdigest && rd->rpmlead[4] != 4)
+    {
+      fprintf(stderr, "%s: no payload digest, cannot do a header only signature\n", filename);
+      exit(1);
+    }
+  hash_init(hctx);
+  hash_write(hctx, hdr, lenhdr);
+  /* remember the header so that rpm_write can check it */
+  md5_init(&md5ctx);
+  md5_write(&md5ctx, hdr, lenhdr);
+  md5_final(rd->rpmmd5sum, &md5ctx);
+  rd->hdrlen = lenhdr;
+  if (lseek(fd, 0, SEEK_CUR) == (off_t)-1)
+    {
+      /* a pipe, keep a copy of everything */
+      rpm_spool_open(rd);
+      rpm_spool_write(rd, hdr, lenhdr);
+      rpm_spool_reserve(rd, rd->hdrin_size - lenhdr);
+      docopy(fd, rd->spoolfd, rd->hdrin_size - lenhdr);
+      rd->spoolsize += rd->hdrin_size - lenhdr;
+    }
+  free(hdr);
+  if (rd->spoolfd < 0 && (u64)rd->rpmstat.st_size != rd->rpmdataoff + rd->hdrin_size)
+    {
+      fprintf(stderr, "%s: SIZE checksum error %llu %llu\n", filename, rd->hdrin_size, (unsigned long long)rd->rpmstat.st_size - rd->rpmdataoff);
+      exit(1);
+    }
+}
+
+/* check that the header is still the one we have hashed */
+static void
+rpm_checkheader(struct rpmdata *rd, int fd)
+{
+  byte *hdr = doalloc(rd->hdrlen);
+  MD5_CTX md5ctx;
+  byte md5[16];
+
+  doseek(fd, rd->rpmdataoff);
+  doread(fd, hdr, rd->hdrlen);
+  md5_init(&md5ctx);
+  md5_write(&md5ctx, hdr, rd->hdrlen);
+  md5_final(md5, &md5ctx);
+  free(hdr);
+  if (memcmp(md5, rd->rpmmd5sum, 16))
+    dodie("rpm has changed, bailing out!");
+}
+
 int
-rpm_read(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *ctx, HASH_CONTEXT *hctx, int getbuildtime)
+rpm_read(struct rpmdata *rd, int fd, char *filename, HASH_CONTEXT *ctx, HASH_CONTEXT *hctx, int getbuildtime, int headeronly, int resign)
 {
   memset(rd, 0, sizeof(*rd));
+  rd->spoolfd = -1;
   rpm_readsigheader(rd, fd, filename);
-  if (rd->gotsigs && ctx != NULL)
+  if (rd->gotsigs && ctx != NULL && !resign)
     {
       rpm_free(rd);
       return 0;	/* already signed */
     }
-  rpm_readheaderpayload(rd, fd, filename, ctx, hctx, getbuildtime);
+  if (headeronly)
+    rpm_readheader(rd, fd, filename, hctx, getbuildtime);
+  else
+    rpm_readheaderpayload(rd, fd, filename, ctx, hctx, getbuildtime);
+  /* drop the old signatures after the checks that need the MD5 tag */
+  if (rd->gotsigs && resign)
+    rpm_delsigs(rd);
   return 1;
 }
 
 void
-rpm_write(struct rpmdata *rd, int foutfd, int fd, int chksumfilefd)
+rpm_write(struct rpmdata *rd, int foutfd, int fd, int chksumfilefd, int digests)
 {
-  byte buf[8192];
+  byte buf[8192], *bp;
   MD5_CTX md5ctx;
-  MD5_CTX chksum_ctx_md5;
-  SHA1_CONTEXT chksum_ctx_sha1;
-  SHA256_CONTEXT chksum_ctx_sha256;
-  SHA512_CONTEXT chksum_ctx_sha512;
-  int l;
+  struct chksum *cs = 0;
+  int l, verify, trustlease = 0;
   byte rpmmd5sum2[16];
+  u64 datalen;
 
-  doseek(fd, rd->rpmdataoff);
+  if (rd->spoolfd >= 0)
+    {
+      /* the input was a pipe, copy from our private spool */
+      fd = rd->spoolfd;
+      verify = 0;
+      datalen = rd->spoolsize;
+      doseek(fd, 0);
+    }
+  else
+    {
+      /* no need to hash the data again if nobody could have modified it */
+      verify = !rpm_unchanged(rd, fd);
+      /* only our own lease can tell if the data changed meanwhile */
+      trustlease = rd->leased && !verify;
+      if (verify && rd->hdrlen)
+	{
+	  /* header only signature, the payload has its own digest */
+	  rpm_checkheader(rd, fd);
+	  verify = 0;
+	}
+      datalen = (u64)rd->rpmstat.st_size - rd->rpmdataoff;
+      doseek(fd, rd->rpmdataoff);
+    }
 
-  dowrite(foutfd, rd->rpmlead, 96);
-  dowrite(foutfd, rd->rpmsighead, 16);
-  dowrite(foutfd, rd->rpmsig, rd->rpmsigsize);
+  if (foutfd >= 0)
+    {
+      dowrite(foutfd, rd->rpmlead, 96);
+      dowrite(foutfd, rd->rpmsighead, 16);
+      dowrite(foutfd, rd->rpmsig, rd->rpmsigsize);
+    }
 
   if (chksumfilefd >= 0)
     {
@@ -669,108 +982,124 @@ rpm_write(struct rpmdata *rd, int foutfd, int fd, int chksumfilefd)
       md5_write(&md5ctx, rd->rpmsig, rd->rpmsigsize);
       md5_final(rd->chksum_leadmd5, &md5ctx);
 
-      md5_init(&chksum_ctx_md5);
-      md5_write(&chksum_ctx_md5, rd->rpmlead, 96);
-      md5_write(&chksum_ctx_md5, rd->rpmsighead, 16);
-      md5_write(&chksum_ctx_md5, rd->rpmsig, rd->rpmsigsize);
-
-      sha1_init(&chksum_ctx_sha1);
-      sha1_write(&chksum_ctx_sha1, rd->rpmlead, 96);
-      sha1_write(&chksum_ctx_sha1, rd->rpmsighead, 16);
-      sha1_write(&chksum_ctx_sha1, rd->rpmsig, rd->rpmsigsize);
-
-      sha256_init(&chksum_ctx_sha256);
-      sha256_write(&chksum_ctx_sha256, rd->rpmlead, 96);
-      sha256_write(&chksum_ctx_sha256, rd->rpmsighead, 16);
-      sha256_write(&chksum_ctx_sha256, rd->rpmsig, rd->rpmsigsize);
-
-      sha512_init(&chksum_ctx_sha512);
-      sha512_write(&chksum_ctx_sha512, rd->rpmlead, 96);
-      sha512_write(&chksum_ctx_sha512, rd->rpmsighead, 16);
-      sha512_write(&chksum_ctx_sha512, rd->rpmsig, rd->rpmsigsize);
+      cs = chksum_start(digests);
+      chksum_write(cs, rd->rpmlead, 96);
+      chksum_write(cs, rd->rpmsighead, 16);
+      chksum_write(cs, rd->rpmsig, rd->rpmsigsize);
     }
   md5_init(&md5ctx);
-  for (;;)
+  if (!verify && !cs)
     {
-      l = read(fd, buf, sizeof(buf));
-      if (l < 0)
-	dodie_errno("read");
-      if (l == 0)
-	break;
-      md5_write(&md5ctx, buf, l);
-      dowrite(foutfd, buf, l);
-      if (chksumfilefd >= 0)
+      /* the size is known to be unchanged, let the kernel copy */
+      if (foutfd >= 0)
+	docopy(fd, foutfd, datalen);
+    }
+  else
+    {
+      for (;;)
 	{
-	  md5_write(&chksum_ctx_md5, buf, l);
-	  sha1_write(&chksum_ctx_sha1, buf, l);
-	  sha256_write(&chksum_ctx_sha256, buf, l);
-	  sha512_write(&chksum_ctx_sha512, buf, l);
+	  /* with a checksum file read straight into the engine's buffers */
+	  bp = cs ? chksum_getbuf(cs) : buf;
+	  l = read(fd, bp, cs ? CHKSUM_BUFSIZE : sizeof(buf));
+	  if (l < 0)
+	    dodie_errno("read");
+	  if (l == 0)
+	    break;
+	  if (verify)
+	    md5_write(&md5ctx, bp, l);
+	  if (foutfd >= 0)
+	    dowrite(foutfd, bp, l);
+	  if (cs)
+	    chksum_putbuf(cs, l);
 	}
     }
   md5_final(rpmmd5sum2, &md5ctx);
-  if (chksumfilefd >= 0)
+  if (cs)
     {
-      md5_final(rd->chksum_md5, &chksum_ctx_md5);
-      sha1_final(&chksum_ctx_sha1);
-      memcpy(rd->chksum_sha1, sha1_read(&chksum_ctx_sha1), 20);
-      sha256_final(&chksum_ctx_sha256);
-      memcpy(rd->chksum_sha256, sha256_read(&chksum_ctx_sha256), 32);
-      sha512_final(&chksum_ctx_sha512);
-      memcpy(rd->chksum_sha512, sha512_read(&chksum_ctx_sha512), 64);
+      byte *out[CHKSUM_NDIGESTS];
+      out[CHKSUM_MD5] = rd->chksum_md5;
+      out[CHKSUM_SHA1] = rd->chksum_sha1;
+      out[CHKSUM_SHA256] = rd->chksum_sha256;
+      out[CHKSUM_SHA512] = rd->chksum_sha512;
+      chksum_finish(cs, out);
     }
-  if (memcmp(rpmmd5sum2, rd->rpmmd5sum, 16))
+  if (verify ? memcmp(rpmmd5sum2, rd->rpmmd5sum, 16) != 0 : trustlease && rpm_lease_broken)
     dodie("rpm has changed, bailing out!");
+  rpm_lease_put(rd);
+}
+
+/* sign the rpm in place by rewriting just the lead and the signature
+ * header. This only works if the new signature header has the same
+ * size as the old one (see rpm_adaptreserved). Returns 0 if the rpm
+ * needs to be written to a new file instead. */
+int
+rpm_write_inplace(struct rpmdata *rd, int fd, char *filename, int chksumfilefd, int digests)
+{
+  u64 len = 96 + 16 + rd->rpmsigsize;
+  byte *region;
+  int wfd;
+
+  if (len != rd->rpmdataoff)
+    return 0;
+  /* make sure the rpm did not change and create the checksums */
+  rpm_write(rd, -1, fd, chksumfilefd, digests);
+  region = doalloc(len);
+  memcpy(region, rd->rpmlead, 96);
+  memcpy(region + 96, rd->rpmsighead, 16);
+  memcpy(region + 96 + 16, rd->rpmsig, rd->rpmsigsize);
+  wfd = inplace_open(filename, fd, 0);
+  inplace_begin(wfd, filename, 0, len);
+  doseek(wfd, 0);
+  dowrite(wfd, region, len);
+  inplace_commit();
+  close(wfd);
+  free(region);
+  return 1;
 }
 
 void
 rpm_free(struct rpmdata *rd)
 {
+  rpm_lease_put(rd);
+  if (rd->spoolfd >= 0)
+    close(rd->spoolfd);
+  rd->spoolfd = -1;
   if (rd->rpmsig)
     free(rd->rpmsig);
   rd->rpmsig = 0;
 }
 
 void
-rpm_writechecksums(struct rpmdata *rd, int chksumfilefd)
+rpm_writechecksums(struct rpmdata *rd, int chksumfilefd, int digests)
 {
+  static const char *names[CHKSUM_NDIGESTS] = { "md5", "sha1", "sha256", "sha512" };
+  static const int lens[CHKSUM_NDIGESTS] = { 16, 20, 32, 64 };
   char buf[16*2 + 5+16*2 + 6+20*2 + 8+32*2 + 8+64*2 + 1], *bp;
-  int i;
+  byte *sums[CHKSUM_NDIGESTS];
+  int i, j;
 
   if (chksumfilefd < 0)
     return;
+  sums[CHKSUM_MD5] = rd->chksum_md5;
+  sums[CHKSUM_SHA1] = rd->chksum_sha1;
+  sums[CHKSUM_SHA256] = rd->chksum_sha256;
+  sums[CHKSUM_SHA512] = rd->chksum_sha512;
   bp = buf;
   for (i = 0; i < 16; i++)
     {
       sprintf(bp, "%02x", rd->chksum_leadmd5[i]);
       bp += 2;
     }
-  strcpy(bp, " md5:");
-  bp += 5;
-  for (i = 0; i < 16; i++)
-    {
-      sprintf(bp, "%02x", rd->chksum_md5[i]);
-      bp += 2;
-    }
-  strcpy(bp, " sha1:");
-  bp += 6;
-  for (i = 0; i < 20; i++)
-    {
-      sprintf(bp, "%02x", rd->chksum_sha1[i]);
-      bp += 2;
-    }
-  strcpy(bp, " sha256:");
-  bp += 8;
-  for (i = 0; i < 32; i++)
-    {
-      sprintf(bp, "%02x", rd->chksum_sha256[i]);
-      bp += 2;
-    }
-  strcpy(bp, " sha512:");
-  bp += 8;
-  for (i = 0; i < 64; i++)
+  for (j = 0; j < CHKSUM_NDIGESTS; j++)
     {
-      sprintf(bp, "%02x", rd->chksum_sha512[i]);
-      bp += 2;
+      if (!(digests & (1 << j)))
+	continue;
+      bp += sprintf(bp, " %s:", names[j]);
+      for (i = 0; i < lens[j]; i++)
+	{
+	  sprintf(bp, "%02x", sums[j][i]);
+	  bp += 2;
+	}
     }
   *bp++ = '\n';
   dowrite(chksumfilefd, (unsigned char *)buf, bp - buf);
@@ -32,6 +32,7 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <pwd.h>
+#include <pthread.h>
 
 #include "inc.h"
 
@@ -50,6 +51,8 @@ char *ssl_certfile;
 char *ssl_keyfile;
 char *ssl_verifyfile;
 char *ssl_verifydir;
+char *ssl_sessioncache;
+int protocol = 2;		/* 3 once every signd and signproxy speaks it */
 
 static const char *const hashname[] = {"SHA1", "SHA256", "SHA512"};
 static const int  hashlen[] = {20, 32, 64};
@@ -62,17 +65,24 @@ static const char *timearg;
 static char *privkey;
 static int privkey_read;
 static int noheaderonly;
+static int headeronly;
+static int resign;
 static int pkcs1pss;
 static char *chksumfile;
 static int chksumfilefd = -1;
+static int chksumdigests = CHKSUM_ALL;
 static int dov4sig;
 static int pubalgoprobe = -1;
+static int siglenprobe;		/* size of the signature returned by the probe */
 static unsigned char fingerprintprobe[33];
 static struct x509 cert;
 static struct x509 othercerts;
 int appxdetached = 0;
 static int cms_flags = 0;
 static int bulk_cpio;
+static int inplace;
+static int nthreads = 1;	/* -j: number of reader threads */
+static int connections = 1;	/* sign.conf: connections to the server */
 static int do_delsign;
 
 #define MODE_UNSET        0
@@ -197,6 +207,7 @@ probe_pubalgo()
     }
   if (outl < 0)
     return -1;
+  siglenprobe = outl;
   sig = pkg2sig(buf, outl, &sigl);
   if (sigl > 4 && sig[0] == 4 && (fp = findsubpkg(sig + 4, sigl - 4, 33, &fpl, -1)) != 0)
     {
@@ -243,16 +254,13 @@ slurp(char *filename, char *buf, int bufl)
 static int
 plainsign_read(int fd, char *filename, HASH_CONTEXT *ctx)
 {
-  byte buf[8192];
-  for (;;)
-    {
-      int l = read(fd, buf, sizeof(buf));
-      if (l < 0)
-	dodie_errno(filename);
-      if (l == 0)
-	break;
-      hash_write(ctx, buf,  l);
-    }
+  struct stream *st = stream_open(fd, STREAM_TOEOF);
+  const byte *buf;
+  size_t l;
+
+  while ((l = stream_read(st, &buf)) != 0)
+    hash_write(ctx, buf, l);
+  stream_close(st);
   return 1;
 }
 
@@ -313,47 +321,132 @@ mode_from_filename(char *filename, int isfilter)
   return mode;
 }
 
-static int
-sign(char *filename, int isfilter, int mode)
-{
+#define SIGN_SIGBUFL	8192	/* room for the signatures of a file */
+#define	BULK_MULTI_MAX	65536	/* files up to this size are hashed in a batch */
+
+static int batchhash;		/* leave small plain files to sign_batchhash */
+
+/* one file on its way through sign: read and hashed, waiting for the
+ * signature, then written */
+struct signjob {
+  char *filename;
+  int isfilter;
+  int mode;
+  int fd;
+  char *outfilename;
+  char *finaloutfilename;	/* rename outfilename to finaloutfilename when done */
+  FILE *fout;
+  int doinplace;
   u32 signtime;
   struct rpmdata rpmrd;
   struct appxdata appxdata;
   struct pedata pedata;
-  byte buf[8192];
+  struct kodata kodata;
+  byte sigtrail[5];
+  unsigned char *v4sigtrail;
+  int v4sigtraillen;
+  struct x509 cms_signedattrs;
+  int ndig;			/* 2 if we also need a header-only signature, 0 if already signed */
+  byte dig[2][64];
+  byte *mbdata;			/* small file and trailer, hashed with the rest of the batch */
+  size_t mblen;
+  byte *sig;			/* the signatures returned by the server */
+  int outl, outlh;
+};
+
+/* Output files that are being written. They are removed if we die
+ * before they are complete, with -j also if another thread dies. */
+static char **sign_tmpouts;
+static int sign_ntmpouts;
+static pthread_mutex_t sign_tmplock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+sign_tmpout_atexit(void)
+{
+  int i;
+
+  /* never released, so that no thread registers a new file */
+  pthread_mutex_lock(&sign_tmplock);
+  for (i = 0; i < sign_ntmpouts; i++)
+    unlink(sign_tmpouts[i]);
+  sign_ntmpouts = 0;
+}
+
+static void
+sign_tmpout_add(char *name)
+{
+  static int atexit_done;
+
+  pthread_mutex_lock(&sign_tmplock);
+  if (!atexit_done++)
+    atexit(sign_tmpout_atexit);
+  if ((sign_ntmpouts & 15) == 0)
+    sign_tmpouts = dorealloc(sign_tmpouts, (sign_ntmpouts + 16) * sizeof(char *));
+  sign_tmpouts[sign_ntmpouts++] = name;
+  pthread_mutex_unlock(&sign_tmplock);
+}
+
+static void
+sign_tmpout_del(char *name)
+{
+  int i;
+
+  pthread_mutex_lock(&sign_tmplock);
+  for (i = 0; i < sign_ntmpouts; i++)
+    if (sign_tmpouts[i] == name)
+      {
+	sign_tmpouts[i] = sign_tmpouts[--sign_ntmpouts];
+	break;
+      }
+  pthread_mutex_unlock(&sign_tmplock);
+}
+
+/* read a small regular file into job->mbdata, so that it can be
+ * hashed together with the other files of a batch */
+static int
+plainsign_readsmall(int fd, struct signjob *job)
+{
+  struct stat stb;
+
+  if (fstat(fd, &stb) || !S_ISREG(stb.st_mode) || stb.st_size > BULK_MULTI_MAX)
+    return 0;
+  job->mbdata = doalloc(stb.st_size + 1);
+  job->mblen = stb.st_size;
+  doread(job->fd, job->mbdata, job->mblen);
+  return 1;
+}
+
+/* read and hash the file, returns 0 if it is already signed */
+static int
+sign_read(struct signjob *job, char *filename, int isfilter, int mode)
+{
   int fd;
-  byte sigtrail[5], *p, *ph = 0;
+  byte *p, *ph = 0;
   HASH_CONTEXT ctx;
   HASH_CONTEXT hctx;
   int force = 1;
-  int outl, outlh;
-  char *outfilename = 0;
-  char *finaloutfilename = 0;	/* rename outfilename to finaloutfilename when done */
-  FILE *fout = 0;
   int getbuildtime = 0;
-  unsigned char *v4sigtrail = 0;
-  int v4sigtraillen = 0;
-  struct x509 cms_signedattrs;
   int needsign;
-  struct x509 sigcb;
-  int sigcbalgo = -1;
   int cmssig = 0;
 
-  if (bulk_cpio)
-    {
-      sign_bulk_cpio(filename, isfilter, mode);
-      return 0;
-    }
-
+  memset(job, 0, sizeof(*job));
   if (mode == MODE_UNSET)
     {
       force = 0;
       mode = mode_from_filename(filename, isfilter);
     }
+  job->filename = filename;
+  job->isfilter = isfilter;
+  job->mode = mode;
 
   if (mode == MODE_APPIMAGESIGN && isfilter)
     dodie("appimage sign cannot work as filter");
 
+  /* modify the file instead of writing a new one */
+  job->doinplace = inplace && !isfilter && (mode == MODE_RPMSIGN || mode == MODE_KOSIGN || mode == MODE_PESIGN || (mode == MODE_APPXSIGN && !appxdetached));
+  if (job->doinplace)
+    inplace_recover(filename);
+
   /* make sure we have a cert for appx/cms sign */
   if (mode == MODE_APPXSIGN || mode == MODE_CMSSIGN || mode == MODE_PESIGN || mode == MODE_KOSIGN)
     {
@@ -378,35 +471,36 @@ sign(char *filename, int isfilter, int mode)
     fd = 0;
   else if ((fd = open(filename, O_RDONLY)) == -1)
     dodie_errno(filename);
+  job->fd = fd;
 
   /* calculate output file name (but do not open yet) */
   if (!isfilter && mode != MODE_APPIMAGESIGN)
     {
-      outfilename = doalloc(strlen(filename) + 16);
+      job->outfilename = doalloc(strlen(filename) + 16);
       if (mode == MODE_DETACHEDSIGN)
-	sprintf(outfilename, "%s.asc", filename);
+	sprintf(job->outfilename, "%s.asc", filename);
       else if (mode == MODE_RAWDETACHEDSIGN || mode == MODE_RAWOPENSSLSIGN)
-	sprintf(outfilename, "%s.sig", filename);
+	sprintf(job->outfilename, "%s.sig", filename);
       else if (mode == MODE_CMSSIGN)
-	sprintf(outfilename, "%s.p7s", filename);
+	sprintf(job->outfilename, "%s.p7s", filename);
       else if (mode == MODE_APPXSIGN && appxdetached)
-	sprintf(outfilename, "%s.p7x", filename);
+	sprintf(job->outfilename, "%s.p7x", filename);
       else
 	{
-	  sprintf(outfilename, "%s.sIgN%d", filename, getpid());
-	  finaloutfilename = filename;
+	  sprintf(job->outfilename, "%s.sIgN%d", filename, getpid());
+	  job->finaloutfilename = filename;
 	}
     }
 
   /* set sign time */
   if (!timearg || mode == MODE_KEYID)
-    signtime = time(NULL);
+    job->signtime = time(NULL);
   else if (*timearg >= '0' && *timearg <= '9')
-    signtime = strtoul(timearg, NULL, 0);
+    job->signtime = strtoul(timearg, NULL, 0);
   else if (mode == MODE_RPMSIGN && !strcmp(timearg, "buildtime"))
     {
       getbuildtime = 1;
-      signtime = 0;		/* rpmsign && buildtime */
+      job->signtime = 0;		/* rpmsign && buildtime */
     }
   else	/* timearg is buildtime or mtime */
     {
@@ -415,7 +509,7 @@ sign(char *filename, int isfilter, int mode)
         dodie_errno("fstat");
       if (S_ISFIFO(stb.st_mode))
 	dodie("cannot use mtime on pipes");
-      signtime = stb.st_mtime;
+      job->signtime = stb.st_mtime;
     }
 
   needsign = 0;
@@ -423,82 +517,85 @@ sign(char *filename, int isfilter, int mode)
   if (mode == MODE_CLEARSIGN)
     {
       /* clearsign is somewhat special: it can open fout */
-      needsign = clearsign(fd, filename, outfilename, &ctx, hashname[hashalgo], isfilter, force, &fout);
+      needsign = clearsign(fd, filename, job->outfilename, &ctx, hashname[hashalgo], isfilter, force, &job->fout);
+      if (job->fout && !isfilter)
+	sign_tmpout_add(job->outfilename);
     }
   else if (mode == MODE_KEYID)
     needsign = 1;	/* sign an empty string */
   else if (mode == MODE_APPXSIGN)
-    needsign = appx_read(&appxdata, fd, filename, &ctx, signtime);
+    needsign = appx_read(&job->appxdata, fd, filename, &ctx, job->signtime, resign);
   else if (mode == MODE_PESIGN)
-    needsign = pe_read(&pedata, fd, filename, &ctx, signtime);
+    needsign = pe_read(&job->pedata, fd, filename, &ctx, job->signtime, resign);
   else if (mode == MODE_KOSIGN)
-    needsign = ko_read(fd, filename, &ctx);
+    needsign = ko_read(&job->kodata, fd, filename, &ctx, resign);
   else if (mode == MODE_APPIMAGESIGN)
     needsign = appimage_read(filename, &ctx);
   else if (mode == MODE_RPMSIGN)
     {
-      needsign = rpm_read(&rpmrd, fd, filename, &ctx, &hctx, getbuildtime);
+      needsign = rpm_read(&job->rpmrd, fd, filename, &ctx, &hctx, getbuildtime, headeronly, resign);
       if (getbuildtime)
-	signtime = rpmrd.buildtime;
+	job->signtime = job->rpmrd.buildtime;
     }
+  else if (batchhash && !isfilter && (mode == MODE_DETACHEDSIGN || mode == MODE_RAWDETACHEDSIGN || mode == MODE_RAWOPENSSLSIGN) && plainsign_readsmall(fd, job))
+    needsign = 1;
   else
     needsign = plainsign_read(fd, filename, &ctx);
 
   if (!needsign)
     {
-      fprintf(isfilter ? stderr : stdout, "%s: already signed\n", filename);
       close(fd);
-      if (outfilename)
-	free(outfilename);
-      if (isfilter)
-	exit(1);
-      return 1;
+      if (job->outfilename)
+	free(job->outfilename);
+      return 0;
     }
-  /* open the socket and connect to signd (clearsign already opened it) */
-  if (mode != MODE_CLEARSIGN)
-    opensocket();
 
   if (mode == MODE_CMSSIGN || mode == MODE_KOSIGN)
     {
-      x509_init(&cms_signedattrs);
+      x509_init(&job->cms_signedattrs);
       if (assertpubalgo == PUB_MLDSA65 || assertpubalgo == PUB_EDDSA)
 	cmssig = 1;
       if (!cmssig)
 	{
 	  hash_final(&ctx);
-	  x509_signedattrs(&cms_signedattrs, hash_read(&ctx), hash_len(), signtime);
+	  x509_signedattrs(&job->cms_signedattrs, hash_read(&ctx), hash_len(), job->signtime);
 	  hash_init(&ctx);
-	  hash_write(&ctx, cms_signedattrs.buf, cms_signedattrs.len);
+	  hash_write(&ctx, job->cms_signedattrs.buf, job->cms_signedattrs.len);
 	}
     }
 
-  if (verbose && mode != MODE_KEYID)
-    {
-      if (*user)
-        fprintf(isfilter ? stderr : stdout, "%s %s user %s\n", modes[mode],  filename, user);
-      else
-        fprintf(isfilter ? stderr : stdout, "%s %s\n", modes[mode],  filename);
-    }
-
   /* finalize the hash for gpg signatures */
   if (mode == MODE_RAWOPENSSLSIGN || mode == MODE_APPXSIGN || mode == MODE_PESIGN || mode == MODE_KOSIGN || mode == MODE_CMSSIGN)
     {
-      sigtrail[0] = pkcs1pss ? 0xbc : 0x00;
-      sigtrail[1] = sigtrail[2] = sigtrail[3] = sigtrail[4] = 0;	/* time does not matter */
+      job->sigtrail[0] = pkcs1pss ? 0xbc : 0x00;
+      job->sigtrail[1] = job->sigtrail[2] = job->sigtrail[3] = job->sigtrail[4] = 0;	/* time does not matter */
     }
   else
     {
       if (dov4sig)
-        v4sigtrail = genv4sigtrail(mode == MODE_CLEARSIGN ? 1 : 0, pubalgoprobe >= 0 ? pubalgoprobe : PUB_RSA, hashalgo, signtime, fingerprintprobe[0] ? fingerprintprobe : 0, &v4sigtraillen);
-      sigtrail[0] = mode == MODE_CLEARSIGN ? 0x01 : 0x00; /* class */
-      sigtrail[1] = signtime >> 24;
-      sigtrail[2] = signtime >> 16;
-      sigtrail[3] = signtime >> 8;
-      sigtrail[4] = signtime;
-      if (v4sigtrail)
-        hash_write(&ctx, v4sigtrail, v4sigtraillen);
+        job->v4sigtrail = genv4sigtrail(mode == MODE_CLEARSIGN ? 1 : 0, pubalgoprobe >= 0 ? pubalgoprobe : PUB_RSA, hashalgo, job->signtime, fingerprintprobe[0] ? fingerprintprobe : 0, &job->v4sigtraillen);
+      job->sigtrail[0] = mode == MODE_CLEARSIGN ? 0x01 : 0x00; /* class */
+      job->sigtrail[1] = job->signtime >> 24;
+      job->sigtrail[2] = job->signtime >> 16;
+      job->sigtrail[3] = job->signtime >> 8;
+      job->sigtrail[4] = job->signtime;
+      if (job->v4sigtrail)
+        hash_write(&ctx, job->v4sigtrail, job->v4sigtraillen);
       else
-        hash_write(&ctx, sigtrail, 5);
+        hash_write(&ctx, job->sigtrail, 5);
+    }
+  if (job->mbdata)
+    {
+      /* the digest is computed by sign_batchhash */
+      if (mode != MODE_RAWOPENSSLSIGN)
+	{
+	  int tl = job->v4sigtrail ? job->v4sigtraillen : 5;
+	  job->mbdata = dorealloc(job->mbdata, job->mblen + tl);
+	  memcpy(job->mbdata + job->mblen, job->v4sigtrail ? job->v4sigtrail : job->sigtrail, tl);
+	  job->mblen += tl;
+	}
+      job->ndig = 1;
+      return 1;
     }
   hash_final(&ctx);
   p = hash_read(&ctx);
@@ -506,79 +603,71 @@ sign(char *filename, int isfilter, int mode)
   /* hack for pure cms-mode cms signatures */
   if (cmssig)
     {
-      sigtrail[0] = 0x43;
-      sigtrail[1] = signtime >> 24;
-      sigtrail[2] = signtime >> 16;
-      sigtrail[3] = signtime >> 8;
-      sigtrail[4] = signtime;
-      x509_signedattrs(&cms_signedattrs, p, hash_len(), signtime);
+      job->sigtrail[0] = 0x43;
+      job->sigtrail[1] = job->signtime >> 24;
+      job->sigtrail[2] = job->signtime >> 16;
+      job->sigtrail[3] = job->signtime >> 8;
+      job->sigtrail[4] = job->signtime;
+      x509_signedattrs(&job->cms_signedattrs, p, hash_len(), job->signtime);
     }
 
-  ph = 0;
-  outlh = 0;
   if (mode == MODE_RPMSIGN)
     {
-      if (v4sigtrail)
-        hash_write(&hctx, v4sigtrail, v4sigtraillen);
+      if (job->v4sigtrail)
+        hash_write(&hctx, job->v4sigtrail, job->v4sigtraillen);
       else
-        hash_write(&hctx, sigtrail, 5);
+        hash_write(&hctx, job->sigtrail, 5);
       hash_final(&hctx);
       /* header only seems to work only if there's a header only hash */
-      if (!noheaderonly && (rpmrd.gotsha1 || rpmrd.gotsha256))
+      if (!noheaderonly && (job->rpmrd.gotsha1 || job->rpmrd.gotsha256))
         ph = hash_read(&hctx);
-      if (rpmrd.rpmlead[4] == 4)
+      if (job->rpmrd.rpmlead[4] == 4 || headeronly)
 	{
 	  /* v6 rpms only have a header-only signature */
 	  if (noheaderonly)
-	    dodie("cannot use --noheaderonly with a v6 rpm");
+	    dodie(headeronly ? "cannot use --noheaderonly with --headeronly" : "cannot use --noheaderonly with a v6 rpm");
 	  if (!ph)
 	    dodie("rpm does not have a payload hash");
 	  p = ph;
 	  ph = 0;
 	}
     }
+  memcpy(job->dig[0], p, hash_len());
+  job->ndig = 1;
+  if (ph)
+    memcpy(job->dig[job->ndig++], ph, hash_len());
+  return 1;
+}
 
-  if (!privkey && !ph)
-    {
-      /* old style sign */
-      char hashhex[1024];
-      digest2arg((byte *)hashhex, p, sigtrail);
-      outl = doreq_old(user, hashhex, hashalgo == HASH_SHA1 ? 0 : hashname[hashalgo], buf, sizeof(buf));
-    }
-  else
-    {
-      /* new style sign with doreq */
-      const char *args[5];
-      char hashhex[1024];
-      char hashhexh[1024];
-      int argc;
+/* tell what we do with the file, called in file order */
+static void
+sign_report(struct signjob *job)
+{
+  FILE *fp = job->isfilter ? stderr : stdout;
 
-      if (privkey)
-        readprivkey();
-      digest2arg((byte *)hashhex, p, sigtrail);
-      if (ph)
-        digest2arg((byte *)hashhexh, ph, sigtrail);
-      args[0] = privkey ? "privsign" : "sign";
-      args[1] = algouser;
-      argc = 2;
-      if (privkey)
-        args[argc++] = privkey;
-      args[argc++] = hashhex;
-      if (ph)
-        args[argc++] = hashhexh;
-      outl = doreq_12(argc, args, buf, sizeof(buf), ph ? &outlh : 0);
-    }
-  if (outl == 0 || (outl > 0 && ph && outlh == 0))
-    {
-      fprintf(stderr, "server returned empty signature");
-      outl = -1;
-    }
-  if (outl < 0)
+  if (!job->ndig)
+    fprintf(fp, "%s: already signed\n", job->filename);
+  else if (verbose && job->mode != MODE_KEYID)
     {
-      if (mode == MODE_CLEARSIGN && !isfilter)
-	unlink(outfilename);
-      exit(-outl);
+      if (*user)
+        fprintf(fp, "%s %s user %s\n", modes[job->mode],  job->filename, user);
+      else
+        fprintf(fp, "%s %s\n", modes[job->mode],  job->filename);
     }
+}
+
+/* incorporate the signature returned by the server */
+static void
+sign_write(struct signjob *job)
+{
+  int mode = job->mode;
+  int isfilter = job->isfilter;
+  byte *buf = job->sig;
+  int bufl = SIGN_SIGBUFL;
+  int outl = job->outl;
+  int outlh = job->outlh;
+  struct x509 sigcb;
+  int sigcbalgo = -1;
 
   if (assertpubalgo >= 0)
     {
@@ -600,18 +689,19 @@ sign(char *filename, int isfilter, int mode)
       if (!issuer)
 	dodie("issuer not found in signature");
       printf("%02X%02X%02X%02X\n", issuer[4], issuer[5], issuer[6], issuer[7]);
-      return 0;
+      free(job->sig);
+      return;
     }
 
   /* transcode signature version if we need the complete pgp signature */
   if (!(mode == MODE_RAWOPENSSLSIGN || mode == MODE_APPXSIGN || mode == MODE_PESIGN || mode == MODE_CMSSIGN || mode == MODE_KOSIGN))
     {
-      outl = fixupsig(sigtrail, v4sigtrail, buf, outl, outlh, sizeof(buf) - outl - outlh);
-      if (ph)
-        outlh = fixupsig(sigtrail, v4sigtrail, buf + outl, outlh, 0, sizeof(buf) - outl - outlh);
+      outl = fixupsig(job->sigtrail, job->v4sigtrail, buf, outl, outlh, bufl - outl - outlh);
+      if (outlh)
+        outlh = fixupsig(job->sigtrail, job->v4sigtrail, buf + outl, outlh, 0, bufl - outl - outlh);
     }
-  if (v4sigtrail)
-    free(v4sigtrail);
+  if (job->v4sigtrail)
+    free(job->v4sigtrail);
 
   /* create openssl signature if needed */
   x509_init(&sigcb);
@@ -628,119 +718,714 @@ sign(char *filename, int isfilter, int mode)
 
   /* finally open the output file */
   if (isfilter)
-    fout = stdout;
-  else if (mode != MODE_CLEARSIGN && mode != MODE_APPIMAGESIGN)
+    job->fout = stdout;
+  else if (mode != MODE_CLEARSIGN && mode != MODE_APPIMAGESIGN && !job->doinplace)
     {
-      if ((fout = fopen(outfilename, "w")) == 0)
-	dodie_errno(outfilename);
+      if ((job->fout = fopen(job->outfilename, "w")) == 0)
+	dodie_errno(job->outfilename);
+      sign_tmpout_add(job->outfilename);
     }
 
   /* write/incorporate signature */
   if (mode == MODE_CLEARSIGN || mode == MODE_DETACHEDSIGN)
     {
-      write_armored_signature(fout, buf, outl);
+      write_armored_signature(job->fout, buf, outl);
     }
   else if (mode == MODE_RAWDETACHEDSIGN)
     {
-      if (fwrite(buf, outl, 1, fout) != 1)
+      if (fwrite(buf, outl, 1, job->fout) != 1)
 	{
 	  perror("fwrite");
 	  if (!isfilter)
-	    unlink(outfilename);
+	    unlink(job->outfilename);
 	  exit(1);
 	}
     }
   else if (mode == MODE_RAWOPENSSLSIGN)
     {
-      if (fwrite(sigcb.buf, sigcb.len, 1, fout) != 1)
+      if (fwrite(sigcb.buf, sigcb.len, 1, job->fout) != 1)
 	{
 	  perror("fwrite");
 	  if (!isfilter)
-	    unlink(outfilename);
+	    unlink(job->outfilename);
 	  exit(1);
 	}
     }
   else if (mode == MODE_RPMSIGN)
     {
-      if (rpm_insertsig(&rpmrd, rpmrd.rpmlead[4] == 4 ? 1 : 0, buf, outl))
+      if (rpm_insertsig(&job->rpmrd, job->rpmrd.rpmlead[4] == 4 || headeronly ? 1 : 0, buf, outl))
 	{
 	  if (!isfilter)
-	    unlink(outfilename);
+	    unlink(job->outfilename);
 	  exit(1);
 	}
-      if (outlh && rpm_insertsig(&rpmrd, 1, buf + outl, outlh))
+      if (outlh && rpm_insertsig(&job->rpmrd, 1, buf + outl, outlh))
 	{
 	  if (!isfilter)
-	    unlink(outfilename);
+	    unlink(job->outfilename);
 	  exit(1);
 	}
-      rpm_write(&rpmrd, isfilter ? 1 : fileno(fout), fd, chksumfilefd);
-      rpm_free(&rpmrd);
+      if (job->doinplace && !rpm_write_inplace(&job->rpmrd, job->fd, job->filename, chksumfilefd, chksumdigests))
+	{
+	  /* the signature header changed its size, write a new rpm */
+	  if (verbose)
+	    printf("%s: cannot sign in place\n", job->filename);
+	  job->doinplace = 0;
+	  if ((job->fout = fopen(job->outfilename, "w")) == 0)
+	    dodie_errno(job->outfilename);
+	  sign_tmpout_add(job->outfilename);
+	}
+      if (!job->doinplace)
+	rpm_write(&job->rpmrd, isfilter ? 1 : fileno(job->fout), job->fd, chksumfilefd, chksumdigests);
+      rpm_free(&job->rpmrd);
     }
   else if (mode == MODE_APPIMAGESIGN)
-    appimage_write_signature(filename, buf, outl);
+    appimage_write_signature(job->filename, buf, outl);
   else if (mode == MODE_APPXSIGN)
     {
-      appx_write(&appxdata, isfilter ? 1 : fileno(fout), fd, &cert, sigcbalgo, &sigcb, &othercerts);
-      appx_free(&appxdata);
+      if (job->doinplace)
+	appx_write_inplace(&job->appxdata, job->fd, job->filename, &cert, sigcbalgo, &sigcb, &othercerts);
+      else
+	appx_write(&job->appxdata, isfilter ? 1 : fileno(job->fout), job->fd, &cert, sigcbalgo, &sigcb, &othercerts);
+      appx_free(&job->appxdata);
     }
   else if (mode == MODE_PESIGN)
     {
-      pe_write(&pedata, isfilter ? 1 : fileno(fout), fd, &cert, sigcbalgo, &sigcb, &othercerts);
-      pe_free(&pedata);
+      if (job->doinplace && !pe_write_inplace(&job->pedata, job->fd, job->filename, &cert, sigcbalgo, &sigcb, &othercerts))
+	{
+	  /* the old certificate table has to go, write a new image */
+	  if (verbose)
+	    printf("%s: cannot sign in place\n", job->filename);
+	  job->doinplace = 0;
+	  if ((job->fout = fopen(job->outfilename, "w")) == 0)
+	    dodie_errno(job->outfilename);
+	  sign_tmpout_add(job->outfilename);
+	}
+      if (!job->doinplace)
+	pe_write(&job->pedata, isfilter ? 1 : fileno(job->fout), job->fd, &cert, sigcbalgo, &sigcb, &othercerts);
+      pe_free(&job->pedata);
     }
   else if (mode == MODE_CMSSIGN)
     {
       struct x509 cb;
       x509_init(&cb);
-      x509_pkcs7_signed_data(&cb, 0, (cms_signedattrs.len ? &cms_signedattrs : 0), sigcbalgo, &sigcb, &cert, &othercerts, cms_flags);
-      dofwrite(fout, cb.buf, cb.len);
+      x509_pkcs7_signed_data(&cb, 0, (job->cms_signedattrs.len ? &job->cms_signedattrs : 0), sigcbalgo, &sigcb, &cert, &othercerts, cms_flags);
+      dofwrite(job->fout, cb.buf, cb.len);
       x509_free(&cb);
     }
   else if (mode == MODE_KOSIGN)
     {
       struct x509 cb;
       x509_init(&cb);
-      x509_pkcs7_signed_data(&cb, 0, (cms_signedattrs.len ? &cms_signedattrs : 0), sigcbalgo, &sigcb, &cert, &othercerts, cms_flags | X509_PKCS7_NO_CERTS);
-      ko_write(isfilter ? 1 : fileno(fout), fd, &cb);
+      x509_pkcs7_signed_data(&cb, 0, (job->cms_signedattrs.len ? &job->cms_signedattrs : 0), sigcbalgo, &sigcb, &cert, &othercerts, cms_flags | X509_PKCS7_NO_CERTS);
+      if (job->doinplace)
+	ko_write_inplace(&job->kodata, job->fd, job->filename, &cb);
+      else
+	ko_write(&job->kodata, isfilter ? 1 : fileno(job->fout), job->fd, &cb);
       x509_free(&cb);
     }
   else
-    dofwrite(fout, buf, outl);
+    dofwrite(job->fout, buf, outl);
 
   x509_free(&sigcb);
+  free(job->sig);
   if (mode == MODE_CMSSIGN || mode == MODE_KOSIGN)
-    x509_free(&cms_signedattrs);
+    x509_free(&job->cms_signedattrs);
 
   /* close and rename output file */
   if (!isfilter)
     {
-      close(fd);
-      if (fout && fclose(fout))
+      close(job->fd);
+      if (job->fout && fclose(job->fout))
 	{
 	  perror("fclose");
-	  unlink(outfilename);
+	  unlink(job->outfilename);
 	  exit(1);
 	}
-      if (finaloutfilename && rename(outfilename, finaloutfilename) != 0)
+      if (job->finaloutfilename && !job->doinplace && rename(job->outfilename, job->finaloutfilename) != 0)
 	{
 	  perror("rename");
-	  unlink(outfilename);
+	  unlink(job->outfilename);
 	  exit(1);
 	}
     }
-  if (outfilename)
-    free(outfilename);
+  if (job->outfilename)
+    {
+      sign_tmpout_del(job->outfilename);
+      free(job->outfilename);
+    }
+}
 
-  /* append to checksums file if needed */
-  if (mode == MODE_RPMSIGN && chksumfilefd >= 0)
-    rpm_writechecksums(&rpmrd, chksumfilefd);
+/* append to checksums file if needed */
+static void
+sign_writechecksums(struct signjob *job)
+{
+  if (job->mode == MODE_RPMSIGN && job->ndig && chksumfilefd >= 0)
+    rpm_writechecksums(&job->rpmrd, chksumfilefd, chksumdigests);
+}
+
+/* the server failed, clean up the clearsign output we already wrote */
+static void
+sign_abort(struct signjob **jobs, int njobs, int status)
+{
+  int i;
+  for (i = 0; i < njobs; i++)
+    if (jobs[i]->mode == MODE_CLEARSIGN && !jobs[i]->isfilter)
+      unlink(jobs[i]->outfilename);
+  exit(status);
+}
+
+/* get the signature for a single file */
+static void
+sign_one(struct signjob *job)
+{
+  byte buf[8192];
+  int outl, outlh = 0;
+  int ph = job->ndig > 1;
+
+  if (!privkey && !ph)
+    {
+      /* old style sign */
+      char hashhex[1024];
+      digest2arg((byte *)hashhex, job->dig[0], job->sigtrail);
+      outl = doreq_old(user, hashhex, hashalgo == HASH_SHA1 ? 0 : hashname[hashalgo], buf, sizeof(buf));
+    }
+  else
+    {
+      /* new style sign with doreq */
+      const char *args[5];
+      char hashhex[1024];
+      char hashhexh[1024];
+      int argc;
+
+      if (privkey)
+        readprivkey();
+      digest2arg((byte *)hashhex, job->dig[0], job->sigtrail);
+      if (ph)
+        digest2arg((byte *)hashhexh, job->dig[1], job->sigtrail);
+      args[0] = privkey ? "privsign" : "sign";
+      args[1] = algouser;
+      argc = 2;
+      if (privkey)
+        args[argc++] = privkey;
+      args[argc++] = hashhex;
+      if (ph)
+        args[argc++] = hashhexh;
+      outl = doreq_12(argc, args, buf, sizeof(buf), ph ? &outlh : 0);
+    }
+  if (outl == 0 || (outl > 0 && ph && outlh == 0))
+    {
+      fprintf(stderr, "server returned empty signature");
+      outl = -1;
+    }
+  if (outl < 0)
+    sign_abort(&job, 1, -outl);
+  job->sig = doalloc(SIGN_SIGBUFL);
+  memcpy(job->sig, buf, outl + outlh);
+  job->outl = outl;
+  job->outlh = outlh;
+}
+
+static int
+sign(char *filename, int isfilter, int mode)
+{
+  struct signjob job;
 
+  if (bulk_cpio)
+    {
+      sign_bulk_cpio(filename, isfilter, mode);
+      return 0;
+    }
+  if (!sign_read(&job, filename, isfilter, mode))
+    {
+      sign_report(&job);
+      if (isfilter)
+	exit(1);
+      return 1;
+    }
+  sign_report(&job);
+  /* open the socket and connect to signd */
+  opensocket();
+  sign_one(&job);
+  sign_write(&job);
+  sign_writechecksums(&job);
   return 0;
 }
 
 #define	BULK_MAX_ARGC	100
 
+/* the answer to a request must fit in 64k, so the number of digests
+ * per request depends on the signature size. Protocol v3 has no such
+ * limit. This does not connect, if we ask for v3 but the server turns
+ * out to be older sign_batch splits the batch. */
+static int
+sign_batchmax(void)
+{
+  int n;
+  if (sockwantversion() == 3)
+    return BULK_MAX_ARGC;
+  if (!siglenprobe)
+    probe_pubalgo();
+  n = 65000 / ((siglenprobe ? siglenprobe + 64 : 4096) + 2);
+  return n > BULK_MAX_ARGC ? BULK_MAX_ARGC : n;
+}
+
+/* build the request for all digests of the jobs, the digests are
+ * stored in *hashhexp */
+static int
+sign_batchargs(struct signjob **jobs, int njobs, int nargs, const char **args, char **hashhexp)
+{
+  byte *bp;
+  int argc, i, j;
+
+  args[0] = "sign";
+  args[1] = algouser;
+  argc = 2;
+  if (privkey)
+    {
+      readprivkey();
+      args[0] = "privsign";
+      args[argc++] = privkey;
+    }
+  *hashhexp = doalloc(nargs * (2 * hash_len() + 1 + 10 + 1));
+  for (i = 0, bp = (byte *)*hashhexp; i < njobs; i++)
+    for (j = 0; j < jobs[i]->ndig; j++)
+      {
+	args[argc++] = (char *)bp;
+	bp = digest2arg(bp, jobs[i]->dig[j], jobs[i]->sigtrail);
+	*bp++ = 0;
+      }
+  return argc;
+}
+
+/* hand the signatures of the answer to the jobs */
+static void
+sign_batchreply(struct signjob **jobs, int njobs, int nargs, byte *buf, int outl)
+{
+  byte *bp;
+  int i, j, outlh;
+
+  if (outl < 0)
+    sign_abort(jobs, njobs, -outl);
+  bp = buf + 2 + 2 * nargs;
+  for (i = j = 0; i < njobs; i++)
+    {
+      outl = buf[2 + 2 * j] << 8 | buf[2 + 2 * j + 1];
+      outlh = 0;
+      if (jobs[i]->ndig > 1)
+	outlh = buf[2 + 2 * (j + 1)] << 8 | buf[2 + 2 * (j + 1) + 1];
+      if (outl == 0 || (jobs[i]->ndig > 1 && outlh == 0))
+	{
+	  fprintf(stderr, "server returned empty signature");
+	  sign_abort(jobs, njobs, 1);
+	}
+      if (outl + outlh > SIGN_SIGBUFL)
+	{
+	  fprintf(stderr, "signature too big\n");
+	  sign_abort(jobs, njobs, 1);
+	}
+      jobs[i]->sig = doalloc(SIGN_SIGBUFL);
+      memcpy(jobs[i]->sig, bp, outl + outlh);
+      jobs[i]->outl = outl;
+      jobs[i]->outlh = outlh;
+      bp += outl + outlh;
+      j += jobs[i]->ndig;
+    }
+}
+
+/* hash the small files of the jobs with hash_multi */
+static void
+sign_batchhash(struct signjob **jobs, int njobs)
+{
+  const byte *mbdata[BULK_MAX_ARGC];
+  size_t mblen[BULK_MAX_ARGC];
+  byte *mbdig[BULK_MAX_ARGC];
+  int i, nmb = 0;
+
+  for (i = 0; i < njobs; i++)
+    if (jobs[i]->mbdata)
+      {
+	mbdata[nmb] = jobs[i]->mbdata;
+	mblen[nmb] = jobs[i]->mblen;
+	mbdig[nmb++] = jobs[i]->dig[0];
+      }
+  if (!nmb)
+    return;
+  hash_multi(hashalgo, nmb, mbdata, mblen, mbdig);
+  for (i = 0; i < njobs; i++)
+    if (jobs[i]->mbdata)
+      {
+	free(jobs[i]->mbdata);
+	jobs[i]->mbdata = 0;
+      }
+}
+
+/* get the signatures for all digests of the jobs with one request */
+static void
+sign_batch(struct signjob **jobs, int njobs, int nargs)
+{
+  const char *args[BULK_MAX_ARGC + 3];
+  char *hashhex;
+  byte *buf;
+  int argc, outl, bufl, maxargs, i, j, n;
+
+  sign_batchhash(jobs, njobs);
+  if (njobs == 1)
+    {
+      sign_one(jobs[0]);
+      return;
+    }
+  sockversion();		/* connect, the server may not speak v3 */
+  maxargs = sign_batchmax();
+  if (nargs > maxargs)
+    {
+      for (i = 0; i < njobs; i = j)
+	{
+	  for (j = i, n = 0; j < njobs && n + jobs[j]->ndig <= maxargs; j++)
+	    n += jobs[j]->ndig;
+	  sign_batch(jobs + i, j - i, n);
+	}
+      return;
+    }
+  argc = sign_batchargs(jobs, njobs, nargs, args, &hashhex);
+  bufl = 2 + nargs * (2 + SIGN_SIGBUFL);
+  if (bufl < 65536)
+    bufl = 65536;
+  buf = doalloc(bufl);
+  outl = doreq(argc, args, buf, bufl, nargs);
+  free(hashhex);
+  sign_batchreply(jobs, njobs, nargs, buf, outl);
+  free(buf);
+}
+
+/* -j: the files are read and hashed by a pool of threads, the main
+ * thread sends the digests of the files that are ready to the server,
+ * and a writer thread incorporates the signatures. With more than one
+ * connection the requests are sent without waiting for the answers,
+ * and the writer takes the jobs in the order their signatures come in.
+ * The jobs stay in a window of slots in file order, so the messages
+ * and the checksum file are in file order as well. */
+
+#define SLOT_EMPTY	0
+#define SLOT_READ	1	/* read and hashed, waiting for the signature */
+#define SLOT_SENT	2	/* request sent, waiting for the answer */
+#define SLOT_DONE	3	/* ready for the writer */
+#define SLOT_WRITTEN	4	/* waiting for the files before it */
+
+struct signpipe {
+  char **filenames;
+  int nfiles;
+  int mode;
+  int nslots;
+  struct signjob **slots;
+  int *state;
+  int next;		/* next file to read */
+  int written;		/* files the writer is done with */
+  int wakefd[2];	/* wakes up the main thread while it polls */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* a request in flight on the connection pool */
+struct signbatch {
+  struct signpipe *sp;
+  int njobs;
+  int nargs;
+  struct signjob *jobs[BULK_MAX_ARGC];
+  int jobidx[BULK_MAX_ARGC];
+};
+
+static void *
+sign_reader(void *arg)
+{
+  struct signpipe *sp = arg;
+  struct signjob *job;
+  int i;
+
+  pthread_mutex_lock(&sp->lock);
+  for (;;)
+    {
+      while (sp->next < sp->nfiles && sp->next >= sp->written + sp->nslots)
+	pthread_cond_wait(&sp->cond, &sp->lock);
+      if (sp->next == sp->nfiles)
+	break;
+      i = sp->next++;
+      pthread_mutex_unlock(&sp->lock);
+      job = doalloc(sizeof(*job));
+      sign_read(job, sp->filenames[i], 0, sp->mode);
+      pthread_mutex_lock(&sp->lock);
+      sp->slots[i % sp->nslots] = job;
+      sp->state[i % sp->nslots] = job->ndig ? SLOT_READ : SLOT_DONE;
+      pthread_cond_broadcast(&sp->cond);
+      if (sp->wakefd[1] != -1 && write(sp->wakefd[1], "", 1) < 0)
+	;		/* the pipe is full, the main thread wakes up anyway */
+    }
+  pthread_mutex_unlock(&sp->lock);
+  return 0;
+}
+
+static void *
+sign_writer(void *arg)
+{
+  struct signpipe *sp = arg;
+  struct signjob *job;
+  int i, slot;
+
+  pthread_mutex_lock(&sp->lock);
+  while (sp->written < sp->nfiles)
+    {
+      slot = sp->written % sp->nslots;
+      if (sp->state[slot] == SLOT_WRITTEN)
+	{
+	  /* report and checksum in file order */
+	  job = sp->slots[slot];
+	  pthread_mutex_unlock(&sp->lock);
+	  sign_report(job);
+	  sign_writechecksums(job);
+	  free(job);
+	  pthread_mutex_lock(&sp->lock);
+	  sp->slots[slot] = 0;
+	  sp->state[slot] = SLOT_EMPTY;
+	  sp->written++;
+	  pthread_cond_broadcast(&sp->cond);
+	  continue;
+	}
+      for (i = sp->written; i < sp->nfiles && i < sp->written + sp->nslots; i++)
+	if (sp->state[i % sp->nslots] == SLOT_DONE)
+	  break;
+      if (i == sp->nfiles || i == sp->written + sp->nslots)
+	{
+	  pthread_cond_wait(&sp->cond, &sp->lock);
+	  continue;
+	}
+      slot = i % sp->nslots;
+      job = sp->slots[slot];
+      pthread_mutex_unlock(&sp->lock);
+      if (job->ndig)
+	sign_write(job);
+      pthread_mutex_lock(&sp->lock);
+      sp->state[slot] = SLOT_WRITTEN;
+    }
+  pthread_mutex_unlock(&sp->lock);
+  return 0;
+}
+
+/* the answer for a request sent over the connection pool */
+static void
+sign_batchdone(void *data, byte *buf, int outl)
+{
+  struct signbatch *b = data;
+  struct signpipe *sp = b->sp;
+  int j;
+
+  sign_batchreply(b->jobs, b->njobs, b->nargs, buf, outl);
+  pthread_mutex_lock(&sp->lock);
+  for (j = 0; j < b->njobs; j++)
+    sp->state[b->jobidx[j] % sp->nslots] = SLOT_DONE;
+  pthread_cond_broadcast(&sp->cond);
+  pthread_mutex_unlock(&sp->lock);
+  free(b);
+}
+
+static void
+sign_pipeline(char **filenames, int nfiles, int mode, int nthreads)
+{
+  struct signpipe sp;
+  struct signbatch *b;
+  struct signjob *jobs[BULK_MAX_ARGC];
+  int jobidx[BULK_MAX_ARGC];
+  const char *args[BULK_MAX_ARGC + 3];
+  char *hashhex;
+  pthread_t *readers, writer;
+  int i, i0, j, n, slot, njobs, nargs, maxargs, argc, usepool, npool = 0;
+  HASH_CONTEXT ctx;
+  byte zero[128];
+
+  /* the connections are opened when the first batch is ready, an idle
+   * v3 connection would be dropped by the server */
+  maxargs = sign_batchmax();
+  usepool = connections > 1 && sockwantversion() == 3;
+  memset(&sp, 0, sizeof(sp));
+  sp.filenames = filenames;
+  sp.nfiles = nfiles;
+  sp.mode = mode;
+  sp.nslots = ((usepool ? connections : 0) + 2) * BULK_MAX_ARGC;
+  if (sp.nslots > nfiles)
+    sp.nslots = nfiles;
+  sp.slots = doalloc(sp.nslots * sizeof(*sp.slots));
+  sp.state = doalloc(sp.nslots * sizeof(*sp.state));
+  memset(sp.slots, 0, sp.nslots * sizeof(*sp.slots));
+  memset(sp.state, 0, sp.nslots * sizeof(*sp.state));
+  sp.wakefd[0] = sp.wakefd[1] = -1;
+  if (usepool)
+    {
+      if (pipe(sp.wakefd))
+	dodie_errno("pipe");
+      fcntl(sp.wakefd[0], F_SETFL, O_NONBLOCK);
+      fcntl(sp.wakefd[1], F_SETFL, O_NONBLOCK);
+    }
+  pthread_mutex_init(&sp.lock, 0);
+  pthread_cond_init(&sp.cond, 0);
+  if (privkey)
+    readprivkey();
+  /* let the hash code pick its transforms before the threads run */
+  memset(zero, 0, sizeof(zero));
+  hash_init(&ctx);
+  hash_write(&ctx, zero, sizeof(zero));
+
+  readers = doalloc(nthreads * sizeof(*readers));
+  for (n = 0; n < nthreads; n++)
+    if (pthread_create(readers + n, 0, sign_reader, &sp))
+      break;
+  if (!n)
+    dodie("could not start the reader threads");
+  if (pthread_create(&writer, 0, sign_writer, &sp))
+    dodie("could not start the writer thread");
+
+  /* send the digests of the files that are ready */
+  i = 0;
+  pthread_mutex_lock(&sp.lock);
+  while (i < nfiles || (npool && pool_pending()))
+    {
+      i0 = i;
+      njobs = nargs = 0;
+      while (i < nfiles && nargs + 2 <= maxargs)
+	{
+	  slot = i % sp.nslots;
+	  if (i < sp.written)
+	    {
+	      i++;		/* already signed, the writer is done with it */
+	      continue;
+	    }
+	  if (i >= sp.written + sp.nslots || sp.state[slot] == SLOT_EMPTY)
+	    {
+	      if (njobs || (npool && pool_pending()))
+		break;		/* not read yet, send what we have */
+	      pthread_cond_wait(&sp.cond, &sp.lock);
+	      continue;
+	    }
+	  if (sp.state[slot] == SLOT_READ)
+	    {
+	      jobidx[njobs] = i;
+	      jobs[njobs++] = sp.slots[slot];
+	      nargs += sp.slots[slot]->ndig;
+	    }
+	  i++;
+	}
+      if (njobs && usepool && !npool && !(npool = pool_open(connections)))
+	usepool = 0;	/* the server does not speak v3 */
+      if (!usepool)
+	{
+	  if (!njobs)
+	    continue;
+	  pthread_mutex_unlock(&sp.lock);
+	  sign_batch(jobs, njobs, nargs);
+	  pthread_mutex_lock(&sp.lock);
+	  for (j = 0; j < njobs; j++)
+	    sp.state[jobidx[j] % sp.nslots] = SLOT_DONE;
+	  pthread_cond_broadcast(&sp.cond);
+	  continue;
+	}
+      /* send a partial batch only if a connection has nothing to do */
+      if (njobs && (nargs + 2 > maxargs || i == nfiles || pool_idle()))
+	{
+	  b = doalloc(sizeof(*b));
+	  b->sp = &sp;
+	  b->njobs = njobs;
+	  b->nargs = nargs;
+	  memcpy(b->jobs, jobs, njobs * sizeof(*jobs));
+	  memcpy(b->jobidx, jobidx, njobs * sizeof(*jobidx));
+	  for (j = 0; j < njobs; j++)
+	    sp.state[jobidx[j] % sp.nslots] = SLOT_SENT;
+	  pthread_mutex_unlock(&sp.lock);
+	  argc = sign_batchargs(jobs, njobs, nargs, args, &hashhex);
+	  if (pool_submit(argc, args, nargs, sign_batchdone, b))
+	    sign_abort(jobs, njobs, 1);
+	  free(hashhex);
+	  pthread_mutex_lock(&sp.lock);
+	  continue;
+	}
+      if (njobs)
+	i = i0;		/* collect them again later */
+      if (!pool_pending())
+	continue;
+      pthread_mutex_unlock(&sp.lock);
+      pool_poll(sp.wakefd[0]);
+      pthread_mutex_lock(&sp.lock);
+    }
+  pthread_mutex_unlock(&sp.lock);
+
+  while (n-- > 0)
+    pthread_join(readers[n], 0);
+  pthread_join(writer, 0);
+  pthread_mutex_destroy(&sp.lock);
+  pthread_cond_destroy(&sp.cond);
+  if (npool)
+    pool_close();
+  if (sp.wakefd[0] != -1)
+    {
+      close(sp.wakefd[0]);
+      close(sp.wakefd[1]);
+    }
+  free(readers);
+  free(sp.slots);
+  free(sp.state);
+}
+
+/* sign a list of files. The files are read and hashed until their
+ * digests fill a request, so that a single round trip to the server
+ * signs many files. */
+static void
+sign_multiple(char **filenames, int nfiles, int mode)
+{
+  struct signjob *jobs[BULK_MAX_ARGC];
+  int njobs = 0, nargs = 0, maxargs, needsign, i;
+
+  if (bulk_cpio)
+    {
+      for (; nfiles > 0; filenames++, nfiles--)
+	sign_bulk_cpio(*filenames, 0, mode);
+      return;
+    }
+  if ((nthreads > 1 || connections > 1) && nfiles > 1)
+    {
+      sign_pipeline(filenames, nfiles, mode, nthreads);
+      return;
+    }
+  maxargs = nfiles > 1 ? sign_batchmax() : BULK_MAX_ARGC;
+  batchhash = nfiles > 1;
+  for (;;)
+    {
+      struct signjob *job;
+      /* a job needs up to two digests */
+      if (njobs && (!nfiles || nargs + 2 > maxargs))
+	{
+	  sign_batch(jobs, njobs, nargs);
+	  for (i = 0; i < njobs; i++)
+	    {
+	      sign_write(jobs[i]);
+	      sign_writechecksums(jobs[i]);
+	      free(jobs[i]);
+	    }
+	  njobs = nargs = 0;
+	}
+      if (!nfiles)
+	break;
+      job = doalloc(sizeof(*job));
+      needsign = sign_read(job, *filenames, 0, mode);
+      sign_report(job);
+      if (needsign)
+	{
+	  jobs[njobs++] = job;
+	  nargs += job->ndig;
+	}
+      else
+	free(job);
+      filenames++;
+      nfiles--;
+    }
+}
+
 static void
 sign_bulk_cpio(char *filename, int isfilter, int mode)
 {
@@ -750,6 +1435,9 @@ sign_bulk_cpio(char *filename, int isfilter, int mode)
   int argc, argsoff;
   char *args[255 + 3];
   byte *ents[255];	/* cpio entries */
+  const byte *mbdata[BULK_MAX_ARGC];	/* small files waiting for hash_multi */
+  size_t mblen[BULK_MAX_ARGC];
+  int mbidx[BULK_MAX_ARGC], nmb = 0;
 
   if (mode != MODE_RAWOPENSSLSIGN)
     dodie("bulk-cpio is only implemented for raw openssl signing");
@@ -795,7 +1483,26 @@ sign_bulk_cpio(char *filename, int isfilter, int mode)
       /* flush out all the cummulated data if we run into a limit */
       if (argc && (type == CPIO_TYPE_TRAILER || (type == CPIO_TYPE_FILE && argc == BULK_MAX_ARGC)))
 	{
-	  int i, outl = doreq(argsoff + argc, (const char **)args, buf, 65536, argc);
+	  int i, outl;
+	  if (nmb)
+	    {
+	      /* hash all the small files in one go */
+	      byte *mbdig[BULK_MAX_ARGC];
+	      byte *digs = doalloc(nmb * 64);
+	      for (i = 0; i < nmb; i++)
+		mbdig[i] = digs + i * 64;
+	      hash_multi(hashalgo, nmb, mbdata, mblen, mbdig);
+	      for (i = 0; i < nmb; i++)
+		{
+		  char *arg = doalloc(2 * hash_len() + 1 + 10 + 1);
+		  digest2arg((byte *)arg, mbdig[i], (const byte *)"\0\0\0\0\0");
+		  args[argsoff + mbidx[i]] = arg;
+		  free((byte *)mbdata[i]);
+		}
+	      free(digs);
+	      nmb = 0;
+	    }
+	  outl = doreq(argsoff + argc, (const char **)args, buf, 65536, argc);
 	  byte *bp = buf + 2 + 2 * argc;
 	  if (outl < 0)
 	    exit(-outl);
@@ -847,18 +1554,37 @@ sign_bulk_cpio(char *filename, int isfilter, int mode)
       else
 	{
 	  HASH_CONTEXT ctx;
+	  struct stream *st;
 	  char *arg;
 
 	  size = cpio_size_get(cpio, &pad);
+	  if (size <= BULK_MULTI_MAX)
+	    {
+	      /* keep small files for hash_multi */
+	      byte *data = doalloc(size ? size : 1);
+	      doread(fd, data, size);
+	      doread(fd, buf, pad);
+	      mbdata[nmb] = data;
+	      mblen[nmb] = size;
+	      mbidx[nmb++] = argc;
+	      args[argsoff + argc] = 0;
+	      ents[argc] = cpio;
+	      argc++;
+	      continue;
+	    }
 	  /* hash file content */
 	  hash_init(&ctx);
+	  st = stream_open(fd, size);
 	  while (size > 0)
 	    {
-	      u32 chunk = size > 8192 ? 8192 : size;
-	      doread(fd, buf, chunk);
-	      hash_write(&ctx, buf, chunk);
+	      const byte *data;
+	      size_t chunk = stream_read(st, &data);
+	      if (!chunk)
+		dodie("unexpeced EOF");
+	      hash_write(&ctx, data, chunk);
 	      size -= chunk;
 	    }
+	  stream_close(st);
 	  doread(fd, buf, pad);
 	  hash_final(&ctx);
 	  /* cummulate */
@@ -915,7 +1641,7 @@ delsign(char *filename, int isfilter, int mode)
       finaloutfilename = filename;
     }
 
-  rpm_read(&rpmrd, fd, filename, NULL, NULL, 0);
+  rpm_read(&rpmrd, fd, filename, NULL, NULL, 0, 0, 0);
 
   if (verbose)
     fprintf(isfilter ? stderr : stdout, "%s %s\n", "rpm delsign",  filename);
@@ -931,7 +1657,7 @@ delsign(char *filename, int isfilter, int mode)
 	dodie_errno(outfilename);
     }
 
-  rpm_write(&rpmrd, isfilter ? 1 : fileno(fout), fd, chksumfilefd);
+  rpm_write(&rpmrd, isfilter ? 1 : fileno(fout), fd, chksumfilefd, chksumdigests);
   rpm_free(&rpmrd);
 
   /* close and rename output file */
@@ -956,7 +1682,7 @@ delsign(char *filename, int isfilter, int mode)
 
   /* append to checksums file if needed */
   if (mode == MODE_RPMSIGN && chksumfilefd >= 0)
-    rpm_writechecksums(&rpmrd, chksumfilefd);
+    rpm_writechecksums(&rpmrd, chksumfilefd, chksumdigests);
 
   return 0;
 }
@@ -1528,6 +2254,13 @@ read_sign_conf(const char *conf)
 	  ssl_verifydir = *bp ? strdup(bp) : 0;
 	  continue;
 	}
+      if (!strcmp(buf, "ssl_sessioncache"))
+	{
+	  if (ssl_sessioncache)
+	    free(ssl_sessioncache);
+	  ssl_sessioncache = *bp ? strdup(bp) : 0;
+	  continue;
+	}
       if (!strcmp(buf, "use-unprivileged-ports"))
 	{
 	  use_unprivileged_ports = 0;
@@ -1546,6 +2279,27 @@ read_sign_conf(const char *conf)
 	  else
 	    dodie("sign.conf: unsupported hash argument");
 	}
+      if (!strcmp(buf, "protocol"))
+	{
+	  protocol = atoi(bp);
+	  if (protocol != 2 && protocol != 3)
+	    dodie("sign.conf: bad protocol argument");
+	  continue;
+	}
+      if (!strcmp(buf, "connections"))
+	{
+	  connections = atoi(bp);
+	  if (connections < 1)
+	    dodie("sign.conf: bad connections argument");
+	  continue;
+	}
+      if (!strcmp(buf, "checksums"))
+	{
+	  chksumdigests = chksum_parse(bp);
+	  if (chksumdigests <= 0)
+	    dodie("sign.conf: unsupported checksums argument");
+	  continue;
+	}
       if (uid && !allowuser && !strcmp(buf, "allowuser"))
 	{
 	  if (pwd && !strcmp(pwd->pw_name, bp))
@@ -1776,6 +2530,10 @@ main(int argc, char **argv)
 	verbose++;
       else if (!strcmp(opt, "--noheaderonly"))
 	noheaderonly = 1;
+      else if (!strcmp(opt, "--headeronly"))
+	headeronly = 1;
+      else if (!strcmp(opt, "--resign"))
+	resign = 1;
       else if (!strcmp(opt, "-k"))
 	mode = MODE_KEYID;
       else if (!strcmp(opt, "-p"))
@@ -1794,6 +2552,14 @@ main(int argc, char **argv)
 	  argc--;
 	  argv++;
 	}
+      else if (argc > 1 && !strcmp(opt, "-j"))
+	{
+	  nthreads = atoi(argv[1]);
+	  if (nthreads < 1)
+	    dodie("-j: need a positive number of threads");
+	  argc--;
+	  argv++;
+	}
       else if (argc > 1 && !strcmp(opt, "-T"))
 	{
 	  timearg = argv[1];
@@ -1846,6 +2612,8 @@ main(int argc, char **argv)
 	cms_flags |= X509_PKCS7_USE_KEYID;
       else if (!strcmp(opt, "--bulk-cpio"))
 	bulk_cpio = 1;
+      else if (!strcmp(opt, "--inplace"))
+	inplace = 1;
       else if (!strcmp(opt, "--fingerprint"))
 	mode = MODE_FINGERPRINT;
       else if (!strcmp(opt, "--delsign"))
@@ -1965,12 +2733,8 @@ main(int argc, char **argv)
     chksumfile_open();
   if (argc == 1)
     sign("<stdin>", 1, mode);
-  else while (argc > 1)
-    {
-      sign(argv[1], 0, mode);
-      argv++;
-      argc--;
-    }
+  else
+    sign_multiple(argv + 1, argc - 1, mode);
   if (chksumfile)
     chksumfile_close();
   x509_free(&cert);
@@ -23,12 +23,20 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/stat.h>
 
 #include "inc.h"
+#include "bele.h"
 
 #ifdef WITH_OPENSSL
 # include <openssl/err.h>
@@ -37,6 +45,10 @@
 
 
 static int sock = -1;
+static int sockout = -1;	/* write side if different from sock */
+static int sockver;		/* 2: one request per connection, 3: protocol v3 */
+static pid_t sock_signd_pid;	/* test mode signd speaking protocol v3 */
+static u32 sockreqid;
 
 extern char *test_sign;
 extern char *host;
@@ -44,27 +56,269 @@ extern int port;
 extern int sockproto;
 extern uid_t uid, euid;
 extern int use_unprivileged_ports;
+extern int protocol;
 
 #ifdef WITH_OPENSSL
 extern char *ssl_keyfile;
 extern char *ssl_certfile;
 extern char *ssl_verifyfile;
 extern char *ssl_verifydir;
+extern char *ssl_sessioncache;
 #endif
 
+/* The servers of the "server" line. Connections are spread over
+ * them by a score: the moving average of the time the server needs to
+ * take a connection and to answer a request, times the number of
+ * connections the server already got in this run. Unknown servers score 0 and are tried first, in random order.
+ * A server that fails is only used again after a back-off time that
+ * doubles with every failure, unless no other server is left. */
+
+#define CONNECT_STAGGER	250	/* ms to wait before trying the next address */
+#define BACKOFF_MAX	64	/* seconds */
+
+struct server {
+  char *name;
+  int port;
+  struct addrinfo *ai;	/* resolved addresses */
+  double ewma;		/* connect and request time in ms, 0 if unknown */
+  int nconn;		/* connections in this run */
+  int fails;		/* failures since the last success */
+  double retry;		/* backed off until this time */
+#ifdef WITH_OPENSSL
+  SSL_SESSION *session;	/* resumed by the next connection */
+  int sessionloaded;
+#endif
+};
+
+static struct server *servers;
+static int nservers;
+static struct server *cursrv;	/* server of the current connection */
+
 #ifdef WITH_OPENSSL
 
 static SSL_CTX *ctx;
 static SSL *ssl;
 
-void
-dodie_ssl_error(const char *msg)
+static void
+print_ssl_error(const char *msg)
 {
   unsigned long e = ERR_get_error();
   fprintf(stderr, "%s: %s\n", msg, ERR_error_string(e, 0));
+  ERR_clear_error();
+}
+
+void
+dodie_ssl_error(const char *msg)
+{
+  print_ssl_error(msg);
   exit(1);
 }
 
+/*
+ * On-disk cache of the last session of every server, so that
+ * short-lived sign runs can resume the session instead of doing a
+ * full handshake each time. The file contains one line per server:
+ *
+ *   <host>:<port> <hex encoded session>
+ *
+ * It holds secrets, so it is only used if it is a regular file owned
+ * by the user with no group/other permissions that lives in a
+ * directory nobody else can write to. Otherwise it is ignored.
+ */
+
+static char *
+sessioncache_path(void)
+{
+  static char *path;
+  struct passwd *pw;
+
+  if (path)
+    return path;
+  if (strncmp(ssl_sessioncache, "~/", 2))
+    return path = ssl_sessioncache;
+  /* do not trust $HOME, we may be running setuid */
+  if (!(pw = getpwuid(uid)) || !pw->pw_dir)
+    return 0;
+  path = doalloc(strlen(pw->pw_dir) + strlen(ssl_sessioncache));
+  sprintf(path, "%s%s", pw->pw_dir, ssl_sessioncache + 1);
+  return path;
+}
+
+static int
+sessioncache_dirok(const char *path)
+{
+  struct stat st;
+  char *dir, *p;
+  int r;
+
+  dir = strdup(path);
+  if (!dir)
+    dodie("out of memory");
+  if ((p = strrchr(dir, '/')) != 0)
+    *(p == dir ? p + 1 : p) = 0;
+  else
+    strcpy(dir, ".");
+  r = stat(dir, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_uid == geteuid() || st.st_uid == 0) && (st.st_mode & 022) == 0;
+  free(dir);
+  return r;
+}
+
+/* read the cache file, returns 0 if it is missing or not trusted */
+static char *
+sessioncache_read(const char *path)
+{
+  struct stat st;
+  char *buf;
+  int fd;
+
+  if (!sessioncache_dirok(path))
+    return 0;
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+    return 0;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0 || st.st_size > 1024 * 1024)
+    {
+      close(fd);
+      return 0;
+    }
+  buf = doalloc(st.st_size + 1);
+  if (read(fd, buf, st.st_size) != st.st_size)
+    {
+      free(buf);
+      close(fd);
+      return 0;
+    }
+  buf[st.st_size] = 0;
+  close(fd);
+  return buf;
+}
+
+static const char *
+sessioncache_key(struct server *srv)
+{
+  static char key[1024];
+  snprintf(key, sizeof(key), "%s:%d", srv->name, srv->port);
+  return key;
+}
+
+/* find the line for our server, returns the start of the line */
+static char *
+sessioncache_find(char *buf, const char *key)
+{
+  size_t kl = strlen(key);
+  char *p;
+
+  for (p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : 0)
+    if (!strncmp(p, key, kl) && p[kl] == ' ')
+      return p;
+  return 0;
+}
+
+static void
+sessioncache_load(struct server *srv)
+{
+  const char *path = sessioncache_path();
+  const char *key = sessioncache_key(srv);
+  char *buf, *p;
+  byte *der;
+  const byte *dp;
+  int l, i;
+  SSL_SESSION *sess;
+
+  if (!path || !(buf = sessioncache_read(path)))
+    return;
+  if ((p = sessioncache_find(buf, key)) != 0)
+    {
+      p += strlen(key) + 1;
+      for (l = 0; p[l] && p[l] != '\n'; l++)
+	;
+      der = doalloc(l / 2 + 1);
+      for (i = 0; i < l / 2; i++)
+	{
+	  int c1 = p[2 * i], c2 = p[2 * i + 1];
+	  c1 = c1 >= 'a' ? c1 - 'a' + 10 : c1 - '0';
+	  c2 = c2 >= 'a' ? c2 - 'a' + 10 : c2 - '0';
+	  der[i] = c1 << 4 | c2;
+	}
+      dp = der;
+      sess = d2i_SSL_SESSION(0, &dp, l / 2);
+      if (sess && SSL_SESSION_is_resumable(sess) && SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) > time(0))
+	srv->session = sess;
+      else if (sess)
+	SSL_SESSION_free(sess);
+      free(der);
+    }
+  free(buf);
+}
+
+/* replace the line of our server, other servers are kept */
+static void
+sessioncache_store(struct server *srv, SSL_SESSION *sess)
+{
+  const char *path = sessioncache_path();
+  const char *key = sessioncache_key(srv);
+  char *old, *p, *q, *tmp;
+  byte *der, *dp;
+  int l, i, fd;
+  FILE *fp;
+
+  if (!path || !sessioncache_dirok(path))
+    return;
+  if ((l = i2d_SSL_SESSION(sess, 0)) <= 0)
+    return;
+  der = dp = doalloc(l);
+  i2d_SSL_SESSION(sess, &dp);
+  old = sessioncache_read(path);
+  tmp = doalloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) == -1 || !(fp = fdopen(fd, "w")))
+    {
+      if (fd != -1)
+	{
+	  close(fd);
+	  unlink(tmp);
+	}
+      free(tmp);
+      free(old);
+      free(der);
+      return;
+    }
+  fprintf(fp, "%s ", key);
+  for (i = 0; i < l; i++)
+    fprintf(fp, "%02x", der[i]);
+  fputc('\n', fp);
+  if (old)
+    {
+      if ((p = sessioncache_find(old, key)) != 0)
+	{
+	  q = strchr(p, '\n');
+	  q = q ? q + 1 : p + strlen(p);
+	  memmove(p, q, strlen(q) + 1);
+	}
+      fputs(old, fp);
+    }
+  if (fclose(fp) || rename(tmp, path))
+    unlink(tmp);
+  free(tmp);
+  free(old);
+  free(der);
+}
+
+/* called by openssl for every new session (or tls1.3 ticket) */
+static int
+ssl_newsession(SSL *s, SSL_SESSION *sess)
+{
+  struct server *srv = SSL_get_app_data(s);
+
+  if (!srv)
+    return 0;
+  if (srv->session)
+    SSL_SESSION_free(srv->session);
+  srv->session = sess;
+  if (ssl_sessioncache)
+    sessioncache_store(srv, sess);
+  return 1;	/* we keep the reference */
+}
+
 void
 init_ssl_ctx()
 {
@@ -83,10 +337,14 @@ init_ssl_ctx()
   if (!ssl_verifyfile && !ssl_verifydir && !SSL_CTX_set_default_verify_paths(ctx))
     dodie("SSL_CTX_set_default_verify_paths failed");
   SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+  /* we keep the sessions ourself, see ssl_newsession */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, ssl_newsession);
 }
 
-void
-ssl_connect(const char *hostname)
+/* returns -1 if the handshake failed */
+static int
+ssl_connect(struct server *srv)
 {
   if (!ctx)
     init_ssl_ctx();
@@ -95,10 +353,20 @@ ssl_connect(const char *hostname)
     dodie("SSL_new failed");
   if (!SSL_set_fd(ssl, sock))
     dodie("SSL_set_fd failed");
-  if (hostname)
-    SSL_set_tlsext_host_name(ssl, hostname);
+  SSL_set_app_data(ssl, srv);
+  SSL_set_tlsext_host_name(ssl, srv->name);
+  if (ssl_sessioncache && !srv->sessionloaded)
+    sessioncache_load(srv);
+  srv->sessionloaded = 1;
+  if (srv->session)
+    SSL_set_session(ssl, srv->session);
   if (SSL_connect(ssl) != 1)
-    dodie_ssl_error("SSL_connect failed");
+    {
+      fprintf(stderr, "%s: ", srv->name);
+      print_ssl_error("SSL_connect failed");
+      return -1;
+    }
+  return 0;
 }
 
 void
@@ -111,66 +379,407 @@ ssl_close()
 
 #endif
 
-void
-opensocket(void)
+/* a signd on the same host, no reserved port or ssl needed */
+static void
+connectunix(const char *path)
 {
-  static int hostknown;
-  static struct sockaddr_in svt;
-  int optval;
+  struct sockaddr_un sun;
 
-  if (test_sign)
-    return;
-#ifndef WITH_OPENSSL
-  if (sockproto == SOCKPROTO_SSL)
-    dodie("not built with SSL support");
-#endif
-  if (!hostknown)
+  if (strlen(path) >= sizeof(sun.sun_path))
+    dodie("unix socket path too long");
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    dodie_errno("socket");
+  if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)))
+    dodie_errno(path);
+}
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* a server is "host", "host:port", "ipv6addr" or "[ipv6addr]:port" */
+static void
+init_servers(void)
+{
+  struct server *srv;
+  char *names, *p, *c;
+
+  names = strdup(host);
+  if (!names)
+    dodie("out of memory");
+  for (p = strtok(names, " \t"); p; p = strtok(0, " \t"))
     {
-      svt.sin_addr.s_addr = inet_addr(host);
-      svt.sin_family = AF_INET;
-      if (svt.sin_addr.s_addr == -1)
+      servers = dorealloc(servers, (nservers + 1) * sizeof(*servers));
+      srv = servers + nservers++;
+      memset(srv, 0, sizeof(*srv));
+      srv->port = port;
+      if (*p == '[' && (c = strchr(p, ']')) != 0)
 	{
-	  struct hostent *hp;
-	  if (!(hp = gethostbyname(host)))
-	    {
-	      printf("%s: unknown host\n", host);
-	      exit(1);
-	    }
-	  memmove(&svt.sin_addr, hp->h_addr, hp->h_length);
-	  svt.sin_family = hp->h_addrtype;
+	  *c++ = 0;
+	  p++;
+	  if (*c == ':')
+	    srv->port = atoi(c + 1);
+	}
+      else if ((c = strchr(p, ':')) != 0 && !strchr(c + 1, ':'))
+	{
+	  *c = 0;
+	  srv->port = atoi(c + 1);
 	}
-      svt.sin_port = htons(port);
-      hostknown = 1;
+      srv->name = p;
     }
-  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-    dodie_errno("socket");
+  if (!nservers)
+    dodie("no server configured");
+}
+
+static int
+resolve_server(struct server *srv)
+{
+  struct addrinfo hints;
+  char portstr[16];
+  int r;
+
+  if (srv->ai)
+    return 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  sprintf(portstr, "%d", srv->port);
+  if ((r = getaddrinfo(srv->name, portstr, &hints, &srv->ai)) != 0)
+    {
+      fprintf(stderr, "%s: %s\n", srv->name, gai_strerror(r));
+      srv->ai = 0;
+      return -1;
+    }
+  return 0;
+}
+
+static void
+server_failed(struct server *srv)
+{
+  int backoff;
+
+  srv->fails++;
+  backoff = srv->fails > 7 ? BACKOFF_MAX : 1 << (srv->fails - 1);
+  if (backoff > BACKOFF_MAX)
+    backoff = BACKOFF_MAX;
+  srv->retry = now_ms() + backoff * 1000.0;
+}
+
+static void
+server_measured(struct server *srv, double ms)
+{
+  srv->ewma = srv->ewma ? 0.7 * srv->ewma + 0.3 * ms : ms;
+}
+
+static void
+server_connected(struct server *srv, double ms)
+{
+  server_measured(srv, ms);
+  srv->fails = 0;
+  srv->retry = 0;
+  srv->nconn++;
+}
+
+/* bindresvport only knows about AF_INET, glibc has no bindresvport6 */
+static int
+bindresvport_in6(int fd)
+{
+  struct sockaddr_in6 sin6;
+  int p;
+
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_addr = in6addr_any;
+  for (p = 600; p < 1024; p++)
+    {
+      sin6.sin6_port = htons(p);
+      if (!bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)))
+	return 0;
+      if (errno != EADDRINUSE)
+	return -1;
+    }
+  errno = EADDRINUSE;
+  return -1;
+}
+
+static void
+bindreserved(int fd, int family)
+{
+  if (uid && euid != uid)
+    {
+      if (seteuid(0))
+	dodie_errno("seteuid");
+    }
+  while ((family == AF_INET6 ? bindresvport_in6(fd) : bindresvport(fd, NULL)) != 0)
+    {
+      if (errno != EADDRINUSE)
+	dodie_errno("bindresvport");
+      sleep(1);
+    }
+  if (uid && euid != uid)
+    {
+      if (seteuid(uid))
+	dodie_errno("seteuid");
+    }
+}
+
+struct attempt {
+  struct server *srv;
+  struct addrinfo *ai;
+  int fd;
+  double start;
+};
+
+/* start a non-blocking connect, returns -1 on immediate failure */
+static int
+start_attempt(struct attempt *a)
+{
+  int err;
+
+  if ((a->fd = socket(a->ai->ai_family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return -1;
   if (!use_unprivileged_ports)
+    bindreserved(a->fd, a->ai->ai_family);
+  fcntl(a->fd, F_SETFL, fcntl(a->fd, F_GETFL) | O_NONBLOCK);
+  a->start = now_ms();
+  if (connect(a->fd, a->ai->ai_addr, a->ai->ai_addrlen) && errno != EINPROGRESS)
+    {
+      err = errno;
+      close(a->fd);
+      a->fd = -1;
+      errno = err;
+      return -1;
+    }
+  return 0;
+}
+
+/* the servers to try, best first. Servers that are backed off come
+ * last, the one that is available again first leads. */
+static int
+order_servers(struct server **order)
+{
+  static unsigned int seed;
+  double now = now_ms(), *key;
+  int i, j, n = 0;
+
+  if (!seed)
+    seed = getpid() ^ time(0);
+  key = doalloc(nservers * sizeof(double));
+  for (i = 0; i < nservers; i++)
+    {
+      /* shuffle, so that ties are broken randomly */
+      j = rand_r(&seed) % (i + 1);
+      order[i] = order[j];
+      order[j] = servers + i;
+    }
+  for (i = 0; i < nservers; i++)
     {
-      if (uid && euid != uid)
+      struct server *srv = order[i];
+      double k = srv->retry > now ? 1e15 + srv->retry : srv->ewma * (1 + srv->nconn);
+      /* insertion sort keeps the shuffled order of equal keys */
+      for (j = n; j > 0 && key[j - 1] > k; j--)
 	{
-	  if (seteuid(0))
-	    dodie_errno("seteuid");
+	  key[j] = key[j - 1];
+	  order[j] = order[j - 1];
 	}
-      while (bindresvport(sock, NULL) != 0)
+      key[j] = k;
+      order[j] = srv;
+      n++;
+    }
+  free(key);
+  return n;
+}
+
+/* Connect to the best server. If a connect does not finish within
+ * CONNECT_STAGGER ms, the next address is tried in parallel and the
+ * first connection that is established wins. Returns -1 if the TLS
+ * handshake with the winner failed, the server is backed off then. */
+static int
+connecttcp(struct server *only)
+{
+  struct server **order;
+  struct attempt *att, *a;
+  struct pollfd *pfds;
+  struct addrinfo *ai;
+  int natt = 0, next = 0, active = 0, i, n, r, err, optval;
+  socklen_t errlen;
+
+  order = doalloc(nservers * sizeof(*order));
+  n = only ? 1 : order_servers(order);
+  if (only)
+    order[0] = only;
+  for (i = 0; i < n; i++)
+    {
+      if (resolve_server(order[i]))
 	{
-	  if (errno != EADDRINUSE)
-	    dodie_errno("bindresvport");
-	  sleep(1);
+	  server_failed(order[i]);
+	  continue;
 	}
-      if (uid && euid != uid)
+      for (ai = order[i]->ai; ai; ai = ai->ai_next)
+	natt++;
+    }
+  att = doalloc((natt ? natt : 1) * sizeof(*att));
+  pfds = doalloc((natt ? natt : 1) * sizeof(*pfds));
+  for (i = natt = 0; i < n; i++)
+    for (ai = order[i]->ai; ai; ai = ai->ai_next, natt++)
+      {
+	att[natt].srv = order[i];
+	att[natt].ai = ai;
+	att[natt].fd = -1;
+      }
+  free(order);
+  a = 0;
+  for (;;)
+    {
+      if (next < natt && !active)
 	{
-	  if (seteuid(uid))
-	    dodie_errno("seteuid");
+	  /* nothing in flight, start the next attempt right away */
+	  if (start_attempt(att + next))
+	    {
+	      perror(att[next].srv->name);
+	      server_failed(att[next].srv);
+	    }
+	  else
+	    active++;
+	  next++;
+	  continue;
+	}
+      if (!active)
+	exit(1);	/* all failed, errors are already printed */
+      for (i = n = 0; i < next; i++)
+	if (att[i].fd != -1)
+	  {
+	    pfds[n].fd = att[i].fd;
+	    pfds[n].events = POLLOUT;
+	    pfds[n++].revents = 0;
+	  }
+      r = poll(pfds, n, next < natt ? CONNECT_STAGGER : -1);
+      if (r < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  dodie_errno("poll");
+	}
+      if (r == 0)
+	{
+	  /* too slow, try the next address in parallel */
+	  if (start_attempt(att + next))
+	    {
+	      perror(att[next].srv->name);
+	      server_failed(att[next].srv);
+	    }
+	  else
+	    active++;
+	  next++;
+	  continue;
+	}
+      for (i = n = 0; i < next && !a; i++)
+	{
+	  if (att[i].fd == -1)
+	    continue;
+	  if (!pfds[n++].revents)
+	    continue;
+	  err = 0;
+	  errlen = sizeof(err);
+	  if (getsockopt(att[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen))
+	    err = errno;
+	  if (!err)
+	    {
+	      a = att + i;
+	      break;
+	    }
+	  fprintf(stderr, "%s: %s\n", att[i].srv->name, strerror(err));
+	  server_failed(att[i].srv);
+	  close(att[i].fd);
+	  att[i].fd = -1;
+	  active--;
 	}
+      if (a)
+	break;
     }
-  if (connect(sock, (struct sockaddr *)&svt, sizeof(svt)))
-    dodie_errno(host);
+  for (i = 0; i < next; i++)
+    if (att[i].fd != -1 && att + i != a)
+      close(att[i].fd);
+  sock = a->fd;
+  cursrv = a->srv;
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
   optval = 1;
   setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+  r = 0;
 #ifdef WITH_OPENSSL
+  if (sockproto == SOCKPROTO_SSL && ssl_connect(cursrv))
+    {
+      server_failed(cursrv);
+      closesocket();
+      r = -1;
+    }
+#endif
+  if (!r)
+    server_connected(cursrv, now_ms() - a->start);
+  free(att);
+  free(pfds);
+  return r;
+}
+
+/* connect to the server, or to the given one again */
+static int
+connectsocket(struct server *only)
+{
+  if (!strncmp(host, "unix:", 5))
+    {
+      /* the kernel tells signd who we are, ssl would not add anything */
+      sockproto = SOCKPROTO_UNPROTECTED;
+      connectunix(host + 5);
+      return 0;
+    }
+#ifndef WITH_OPENSSL
   if (sockproto == SOCKPROTO_SSL)
-    ssl_connect(host);
+    dodie("not built with SSL support");
 #endif
+  if (!nservers)
+    init_servers();
+  return connecttcp(only);
+}
+
+/* start a signd --test-sign that serves all requests of this run */
+static void
+start_test_signd(void)
+{
+  int pin[2], pout[2];
+  pid_t pid;
+
+  if (pipe(pin) == -1 || pipe(pout) == -1)
+    dodie_errno("pipe");
+  if ((pid = fork()) == (pid_t)-1)
+    dodie_errno("fork");
+  if (pid == 0)
+    {
+      dup2(pin[0], 0);
+      dup2(pout[1], 1);
+      close(pin[0]);
+      close(pin[1]);
+      close(pout[0]);
+      close(pout[1]);
+      execlp(test_sign, test_sign, "--test-sign", (char *)0);
+      perror(test_sign);
+      _exit(1);
+    }
+  close(pin[0]);
+  close(pout[1]);
+  /* later test signds must not keep the pipes open */
+  fcntl(pout[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pin[1], F_SETFD, FD_CLOEXEC);
+  sock = pout[0];
+  sockout = pin[1];
+  sock_signd_pid = pid;
 }
 
 void
@@ -179,11 +788,22 @@ closesocket()
 #ifdef WITH_OPENSSL
   ssl_close();
 #endif
+  if (sockout != -1)
+    {
+      close(sockout);
+      sockout = -1;
+    }
   if (sock != -1)
     {
       close(sock);
       sock = -1;
     }
+  if (sock_signd_pid)
+    {
+      int status;
+      waitpid(sock_signd_pid, &status, 0);
+      sock_signd_pid = 0;
+    }
 }
 
 static inline ssize_t
@@ -203,7 +823,129 @@ writesocket(void *buf, size_t count)
   if (!test_sign && sockproto == SOCKPROTO_SSL)
     return SSL_write(ssl, buf, count);
 #endif
-  return write(sock, buf, count);
+  return write(sockout != -1 ? sockout : sock, buf, count);
+}
+
+/* read exactly count bytes */
+static int
+readsocket_full(byte *buf, int count)
+{
+  while (count > 0)
+    {
+      int l = readsocket(buf, count);
+      if (l <= 0)
+	{
+	  if (l == 0)
+	    fprintf(stderr, "unexpected EOF from server\n");
+	  else
+	    perror("read");
+	  return -1;
+	}
+      buf += l;
+      count -= l;
+    }
+  return 0;
+}
+
+static int
+writesocket_full(byte *buf, int count)
+{
+  while (count > 0)
+    {
+      int l = writesocket(buf, count);
+      if (l <= 0)
+	{
+	  perror("write");
+	  return -1;
+	}
+      buf += l;
+      count -= l;
+    }
+  return 0;
+}
+
+/* Ask for protocol v3 with a "ping" request that has "proto3" as
+ * extra argument. A v3 server answers with a single "proto3" result
+ * and keeps the connection open, older servers send an empty answer
+ * and close it. Returns -1 if we got no answer at all. */
+static int
+negotiate(void)
+{
+  static byte ping3[] = { 0, 18, 0, 0, 0, 3, 0, 4, 0, 0, 0, 6, 'p', 'i', 'n', 'g', 'p', 'r', 'o', 't', 'o', '3' };
+  static byte ack3[] = { 0, 0, 0, 10, 0, 0, 0, 1, 0, 6, 'p', 'r', 'o', 't', 'o', '3' };
+  byte buf[sizeof(ack3)];
+
+  if (writesocket_full(ping3, sizeof(ping3)))
+    return -1;
+  if (readsocket_full(buf, 6))
+    return -1;
+  if (memcmp(buf, ack3, 6))
+    return 2;
+  if (readsocket_full(buf + 6, sizeof(ack3) - 6))
+    return -1;
+  return memcmp(buf, ack3, sizeof(ack3)) ? 2 : 3;
+}
+
+/* the protocol we are going to ask for, without connecting */
+int
+sockwantversion(void)
+{
+  const char *e = getenv("SIGN_PROTO");
+  if (sockver)
+    return sockver;
+  return protocol < 3 || (e && !strcmp(e, "2")) ? 2 : 3;
+}
+
+/* A server that fails the TLS handshake or does not answer the
+ * negotiation is backed off like one that refuses the connection, and
+ * the next one is tried. */
+void
+opensocket(void)
+{
+  int v = 0, tries;
+
+  if (sock != -1)
+    return;		/* already connected */
+  if (!sockver && sockwantversion() == 2)
+    sockver = 2;
+  if (test_sign && sockver == 2)
+    return;		/* every request starts its own signd */
+  /* a server that goes away is an error we handle, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+  for (tries = 0; ; tries++)
+    {
+      if (tries && (test_sign || !cursrv || tries >= nservers))
+	exit(1);	/* errors are already printed */
+      if (test_sign)
+	start_test_signd();
+      else if (connectsocket(0))
+	continue;
+      if (sockver == 2)
+	return;
+      if ((v = negotiate()) > 0)
+	break;
+      if (cursrv)
+	{
+	  fprintf(stderr, "%s: protocol negotiation failed\n", cursrv->name);
+	  server_failed(cursrv);
+	}
+      closesocket();
+    }
+  sockver = v;
+  if (sockver == 3)
+    return;
+  /* old server, it closed the connection after the ping */
+  closesocket();
+  if (!test_sign && connectsocket(cursrv))
+    exit(1);
+}
+
+/* the protocol spoken with the server: 3 if replies may exceed 64k */
+int
+sockversion(void)
+{
+  opensocket();
+  return sockver;
 }
 
 
@@ -274,13 +1016,314 @@ reap_test_signd()
     }
 }
 
+/* Protocol v3 frames have 32 bit lengths and carry a request id that
+ * the server echoes, so requests can be pipelined:
+ *   request: u32 len, u32 id, u16 argc, argc * u32 arglen, args
+ *   reply:   u32 len, u32 id, u16 status, u16 nout, nout * u32 outlen,
+ *            u32 errlen, outs, err
+ * len counts the bytes after itself. Digest arguments ("hex@hex") are
+ * sent in binary with the top bit of arglen set. */
+
+#define PROTO3_MAXLEN	0x1000000
+
+static int
+isdigestarg(const byte *arg, int l)
+{
+  int i;
+  if (l < 13 || (l - 11) % 2 != 0 || arg[l - 11] != '@')
+    return 0;
+  for (i = 0; i < l; i++)
+    if (i != l - 11 && !((arg[i] >= '0' && arg[i] <= '9') || (arg[i] >= 'a' && arg[i] <= 'f')))
+      return 0;
+  return 1;
+}
+
+static inline int
+hexval(byte c)
+{
+  return c <= '9' ? c - '0' : c - 'a' + 10;
+}
+
+/* build a request frame, returns 0 if it is too big */
+static byte *
+sock3_encode(u32 id, int argc, const byte **argv, const int *argl, size_t *lenp)
+{
+  byte *req, *bp;
+  size_t len = 4 + 4 + 2;
+  int i, j;
+
+  for (i = 0; i < argc; i++)
+    len += 4 + (isdigestarg(argv[i], argl[i]) ? (argl[i] - 1) / 2 : argl[i]);
+  if (len > PROTO3_MAXLEN)
+    {
+      fprintf(stderr, "request too big\n");
+      return 0;
+    }
+  req = doalloc(len);
+  bp = req;
+  setbe4(bp, len - 4);
+  setbe4(bp + 4, id);
+  bp[8] = argc >> 8;
+  bp[9] = argc;
+  bp += 10;
+  for (i = 0; i < argc; i++, bp += 4)
+    if (isdigestarg(argv[i], argl[i]))
+      setbe4(bp, (u32)((argl[i] - 1) / 2) | 0x80000000);
+    else
+      setbe4(bp, argl[i]);
+  for (i = 0; i < argc; i++)
+    {
+      if (!isdigestarg(argv[i], argl[i]))
+	{
+	  memcpy(bp, argv[i], argl[i]);
+	  bp += argl[i];
+	  continue;
+	}
+      for (j = 0; j < argl[i]; j += 2)
+	{
+	  if (argv[i][j] == '@')
+	    j++;
+	  *bp++ = hexval(argv[i][j]) << 4 | hexval(argv[i][j + 1]);
+	}
+    }
+  *lenp = len;
+  return req;
+}
+
+static int
+sock3_send(u32 id, int argc, const byte **argv, const int *argl)
+{
+  size_t len;
+  byte *req = sock3_encode(id, argc, argv, argl, &len);
+  int r;
+
+  if (!req)
+    return -1;
+  r = writesocket_full(req, len);
+  free(req);
+  return r;
+}
+
+/* read the next reply, returns the frame after the length */
+static byte *
+sock3_recv(u32 *lenp)
+{
+  byte hdr[4], *rep;
+  u32 len;
+
+  if (readsocket_full(hdr, 4))
+    return 0;
+  len = getbe4(hdr);
+  if (len < 12 || len > PROTO3_MAXLEN)
+    {
+      fprintf(stderr, "bad packet size %u\n", (unsigned int)len);
+      return 0;
+    }
+  rep = doalloc(len);
+  if (readsocket_full(rep, len))
+    {
+      free(rep);
+      return 0;
+    }
+  *lenp = len;
+  return rep;
+}
+
+/* convert a reply to the format of the old protocols, as signd would
+ * have sent it: the single result for old format requests, otherwise
+ * the number of results, their 16 bit lengths and the data. Returns
+ * the length, or the negated status if the server reported an error. */
+static int
+sock3_decode(byte *rep, u32 len, byte *buf, int bufl, int oldfmt)
+{
+  u32 nout, off, outl, errl, l;
+  int i;
+
+  nout = rep[6] << 8 | rep[7];
+  if (len < 8 + 4 * nout + 4)
+    {
+      fprintf(stderr, "bad reply from server\n");
+      return -1;
+    }
+  off = 8 + 4 * nout + 4;
+  for (i = 0, outl = 0; i < nout && outl <= len; i++)
+    outl += getbe4(rep + 8 + 4 * i) > len ? len + 1 : getbe4(rep + 8 + 4 * i);
+  errl = getbe4(rep + 8 + 4 * nout);
+  if (outl > len || errl > len || off + outl + errl != len)
+    {
+      fprintf(stderr, "packet size mismatch\n");
+      return -1;
+    }
+  if (errl)
+    fwrite(rep + off + outl, 1, errl, stderr);
+  if (rep[4] << 8 | rep[5])
+    return -(rep[4] << 8 | rep[5]);
+  if (oldfmt)
+    {
+      if (nout > 1 || outl > bufl)
+	{
+	  fprintf(stderr, "bad reply from server\n");
+	  return -1;
+	}
+      memcpy(buf, rep + off, outl);
+      return outl;
+    }
+  if (!nout)
+    return 0;
+  if (2 + 2 * nout + outl > bufl)
+    {
+      fprintf(stderr, "packet too big\n");
+      return -1;
+    }
+  buf[0] = nout >> 8;
+  buf[1] = nout;
+  for (i = 0; i < nout; i++)
+    {
+      l = getbe4(rep + 8 + 4 * i);
+      if (l > 65535)
+	{
+	  fprintf(stderr, "packet too big\n");
+	  return -1;
+	}
+      buf[2 + 2 * i] = l >> 8;
+      buf[2 + 2 * i + 1] = l;
+    }
+  memcpy(buf + 2 + 2 * nout, rep + off, outl);
+  return outl + 2 + 2 * nout;
+}
+
+/* do a request in protocol v3. The old format request in buf is
+ * converted and the answer is returned in the format of the old
+ * protocols, as signd would have sent it. */
+static int
+doreq_raw3(byte *buf, int inbufl, int bufl)
+{
+  const byte *argv[3], **argvp = argv;
+  int argl[3], *arglp = argl;
+  char userbuf[256];
+  int argc, i, hl, al, oldfmt = 0;
+  u32 len, off, id;
+  byte *rep;
+
+  hl = buf[0] << 8 | buf[1];
+  al = buf[2] << 8 | buf[3];
+  if (al == 0 && hl != 0)
+    {
+      /* new format */
+      argc = buf[4] << 8 | buf[5];
+      argvp = doalloc(argc * sizeof(*argvp));
+      arglp = doalloc(argc * sizeof(*arglp));
+      off = 6 + 2 * argc;
+      for (i = 0; i < argc; i++)
+	{
+	  arglp[i] = buf[6 + 2 * i] << 8 | buf[6 + 2 * i + 1];
+	  argvp[i] = buf + off;
+	  off += arglp[i];
+	}
+    }
+  else if (al == 0)
+    {
+      /* old ping */
+      oldfmt = 1;
+      argc = 2;
+      argv[0] = (const byte *)"ping";
+      argl[0] = 4;
+      argv[1] = buf;
+      argl[1] = 0;
+    }
+  else
+    {
+      /* old sign/pubkey request, the hashalgo is attached to the digest */
+      const byte *arg = buf + 4 + hl, *p;
+      oldfmt = 1;
+      argc = 3;
+      argv[1] = buf + 4;
+      argl[1] = hl;
+      for (p = arg; p < arg + al && *p != ':'; p++)
+	;
+      if (p < arg + al && hl + (p - arg) + 1 < sizeof(userbuf))
+	{
+	  memcpy(userbuf, arg, p - arg + 1);
+	  memcpy(userbuf + (p - arg) + 1, buf + 4, hl);
+	  argv[1] = (byte *)userbuf;
+	  argl[1] = hl + (p - arg) + 1;
+	  al -= p + 1 - arg;
+	  arg = p + 1;
+	}
+      argv[0] = (const byte *)"sign";
+      argl[0] = 4;
+      argv[2] = arg;
+      argl[2] = al;
+      if (al == 6 && !memcmp(arg, "PUBKEY", 6))
+	{
+	  argv[0] = (const byte *)"pubkey";
+	  argl[0] = 6;
+	  argc = 2;
+	}
+    }
+  id = ++sockreqid;
+  i = sock3_send(id, argc, argvp, arglp);
+  if (argvp != argv)
+    {
+      free(argvp);
+      free(arglp);
+    }
+  if (i || !(rep = sock3_recv(&len)))
+    {
+      closesocket();
+      return -1;
+    }
+  if (getbe4(rep) != id)
+    {
+      fprintf(stderr, "bad reply from server\n");
+      free(rep);
+      closesocket();
+      return -1;
+    }
+  i = sock3_decode(rep, len, buf, bufl, oldfmt);
+  if (i < 0 && !(rep[4] << 8 | rep[5]))
+    closesocket();
+  free(rep);
+  return i;
+}
+
+/* signd drops protocol v3 connections that are idle for too long. The
+ * connection has nothing to read between requests, so if it is
+ * readable the server has closed it. */
+static int
+sock_dropped(void)
+{
+  struct pollfd pfd;
+
+#ifdef WITH_OPENSSL
+  if (ssl && SSL_pending(ssl))
+    return 1;
+#endif
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
 int
 doreq_raw(byte *buf, int inbufl, int bufl)
 {
+  struct server *srv;
+  double start;
   int l, outl, errl;
 
+  if (sock != -1 && sockver == 3 && sock_dropped())
+    closesocket();
   if (sock == -1)
     opensocket();		/* better late then never */
+  srv = test_sign ? 0 : cursrv;
+  start = now_ms();
+  if (sockver == 3)
+    {
+      l = doreq_raw3(buf, inbufl, bufl);
+      if (srv && sock != -1)
+	server_measured(srv, now_ms() - start);
+      return l;
+    }
   if (test_sign)
     doreq_test(buf, inbufl, bufl);
   else if (writesocket(buf, inbufl) != inbufl)
@@ -311,6 +1354,8 @@ doreq_raw(byte *buf, int inbufl, int bufl)
 	break;
       l += ll;
     }
+  if (srv)
+    server_measured(srv, now_ms() - start);
   closesocket();
   if (test_sign)
     reap_test_signd();
@@ -360,11 +1405,40 @@ doreq_old(const char *user, const char *digest, const char *digestalgo, byte *bu
   return doreq_raw(buf, 4 + userlen + digestalgolen + digestlen, bufl);
 }
 
+/* verify that the answer has nret results */
+static int
+checkreply(byte *buf, int outl, int nret)
+{
+  int i, l;
+
+  if (!nret)
+    return outl;
+  if (outl < 2 + 2 * nret)
+    {
+      fprintf(stderr, "answer too small\n");
+      return -1;
+    }
+  if (buf[0] != 0 || buf[1] != nret)
+    {
+      fprintf(stderr, "bad return count\n");
+      return -1;
+    }
+  l = 2;
+  for (i = 0; i < nret; i++)
+    l += 2 + (buf[2 + i * 2] << 8 | buf[2 + i * 2 + 1]);
+  if (l != outl)
+    {
+      fprintf(stderr, "answer size mismatch\n");
+      return -1;
+    }
+  return outl;
+}
+
 int
 doreq(int argc, const char **argv, byte *buf, int bufl, int nret)
 {
   byte *bp;
-  int i, l, v, outl;
+  int i, v, outl;
 
   bp = buf + 2;
   *bp++ = 0;
@@ -396,30 +1470,7 @@ doreq(int argc, const char **argv, byte *buf, int bufl, int nret)
   outl = doreq_raw(buf, (int)(bp - buf), bufl);
   if (outl < 0)
     return outl;
-
-  if (nret)
-    {
-      /* verify returned data */
-      if (outl < 2 + 2 * nret)
-	{
-	  fprintf(stderr, "answer too small\n");
-	  return -1;
-	}
-      if (buf[0] != 0 || buf[1] != nret)
-	{
-	  fprintf(stderr, "bad return count\n");
-	  return -1;
-	}
-      l = 2;
-      for (i = 0; i < nret; i++)
-	l += 2 + (buf[2 + i * 2] << 8 | buf[2 + i * 2 + 1]);
-      if (l != outl)
-	{
-	  fprintf(stderr, "answer size mismatch\n");
-	  return -1;
-	}
-    }
-  return outl;
+  return checkreply(buf, outl, nret);
 }
 
 /* do a request with one or two results */
@@ -442,3 +1493,457 @@ doreq_12(int argc, const char **argv, byte *buf, int bufl, int *outl2p)
   return outl;
 }
 
+
+
+/* A pool of protocol v3 connections that carry several requests at
+ * once. The connections are set up like the normal one and then
+ * switched to non-blocking io. Requests go to the connection with the
+ * fewest requests in flight, and the replies are passed to the done
+ * callback of their request in the order they come in. A connection
+ * the server closed while idle is opened again when it is needed. If
+ * it breaks with requests in flight, the server is backed off and the
+ * requests are sent again over a new connection. */
+
+#define POOL_RESEND_MAX	3	/* times a request is sent again */
+
+struct poolconn {
+  int fd;
+  int fdout;
+  pid_t pid;
+  struct server *srv;	/* 0 for unix sockets and test mode */
+#ifdef WITH_OPENSSL
+  SSL *ssl;
+#endif
+  byte *wbuf;		/* requests not sent yet */
+  size_t wlen, woff;
+  byte *rbuf;		/* partial replies */
+  size_t rlen, rsize;
+  int inflight;
+  int eof;		/* closed, opened again when needed */
+  int broken;		/* could not be opened again */
+};
+
+struct poolreq {
+  u32 id;
+  struct poolconn *conn;
+  int nret;
+  void (*done)(void *data, byte *buf, int outl);
+  void *data;
+  byte *frame;		/* kept to send it again */
+  size_t framelen;
+  int resent;
+  double start;		/* when it was queued, for the server score */
+  struct poolreq *next;
+};
+
+static struct poolconn *pool;
+static int npool;
+static struct poolreq *poolreqs;
+static int poolinflight;
+
+/* (re)open a pool connection, returns -1 if the server we got does
+ * not speak protocol v3 */
+static int
+pool_connect(struct poolconn *c)
+{
+  opensocket();
+  if (sockver != 3)
+    return -1;
+  c->fd = sock;
+  c->fdout = sockout != -1 ? sockout : sock;
+  c->pid = sock_signd_pid;
+  c->srv = test_sign ? 0 : cursrv;
+#ifdef WITH_OPENSSL
+  c->ssl = ssl;
+  ssl = 0;
+  if (c->ssl)
+    SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#endif
+  sock = sockout = -1;
+  sock_signd_pid = 0;
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+  if (c->fdout != c->fd)
+    fcntl(c->fdout, F_SETFL, fcntl(c->fdout, F_GETFL) | O_NONBLOCK);
+  c->eof = 0;
+  return 0;
+}
+
+static void
+pool_disconnect(struct poolconn *c)
+{
+  int status;
+
+  if (c->eof)
+    return;
+#ifdef WITH_OPENSSL
+  if (c->ssl)
+    SSL_free(c->ssl);
+  c->ssl = 0;
+#endif
+  if (c->fdout != c->fd)
+    close(c->fdout);
+  close(c->fd);
+  c->fd = c->fdout = -1;
+  if (c->pid)
+    waitpid(c->pid, &status, 0);
+  c->pid = 0;
+  c->wlen = c->woff = c->rlen = 0;
+  c->eof = 1;
+}
+
+/* open up to n connections, returns 0 if the server does not speak
+ * protocol v3 */
+int
+pool_open(int n)
+{
+  if (npool)
+    return npool;
+  pool = doalloc(n * sizeof(*pool));
+  memset(pool, 0, n * sizeof(*pool));
+  while (npool < n && !pool_connect(pool + npool))
+    npool++;
+  if (!npool)
+    {
+      free(pool);
+      pool = 0;
+    }
+  return npool;
+}
+
+void
+pool_close(void)
+{
+  struct poolconn *c;
+
+  for (c = pool; c < pool + npool; c++)
+    {
+      pool_disconnect(c);
+      free(c->wbuf);
+      free(c->rbuf);
+    }
+  free(pool);
+  pool = 0;
+  npool = 0;
+}
+
+/* returns the number of bytes written, 0 if the connection would block
+ * and -1 if it is broken */
+static ssize_t
+pool_write(struct poolconn *c, const byte *buf, size_t len)
+{
+  ssize_t r;
+#ifdef WITH_OPENSSL
+  if (c->ssl)
+    {
+      r = SSL_write(c->ssl, buf, len);
+      if (r > 0)
+	return r;
+      r = SSL_get_error(c->ssl, r);
+      if (r == SSL_ERROR_WANT_READ || r == SSL_ERROR_WANT_WRITE)
+	return 0;
+      print_ssl_error("SSL_write");
+      return -1;
+    }
+#endif
+  r = write(c->fdout, buf, len);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (r <= 0)
+    {
+      perror("write");
+      return -1;
+    }
+  return r;
+}
+
+/* returns the number of bytes read, 0 if the connection would block
+ * and -1 on EOF or if it is broken */
+static ssize_t
+pool_read(struct poolconn *c, byte *buf, size_t len)
+{
+  ssize_t r;
+#ifdef WITH_OPENSSL
+  if (c->ssl)
+    {
+      r = SSL_read(c->ssl, buf, len);
+      if (r > 0)
+	return r;
+      r = SSL_get_error(c->ssl, r);
+      if (r == SSL_ERROR_WANT_READ || r == SSL_ERROR_WANT_WRITE)
+	return 0;
+      if (r != SSL_ERROR_ZERO_RETURN)
+	print_ssl_error("SSL_read");
+      return -1;
+    }
+#endif
+  r = read(c->fd, buf, len);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (r < 0)
+    perror("read");
+  return r > 0 ? r : -1;
+}
+
+static void pool_lost(struct poolconn *c);
+
+static void
+pool_flush(struct poolconn *c)
+{
+  ssize_t l = 0;
+  while (c->woff < c->wlen && (l = pool_write(c, c->wbuf + c->woff, c->wlen - c->woff)) > 0)
+    c->woff += l;
+  if (c->woff < c->wlen && l < 0)
+    {
+      pool_lost(c);
+      return;
+    }
+  if (c->woff == c->wlen)
+    c->woff = c->wlen = 0;
+}
+
+static void pool_input(struct poolconn *c);
+
+/* the connection for the next request. One the server closed counts
+ * as busy with one request, as it has to be opened first. */
+static struct poolconn *
+pool_pick(void)
+{
+  struct poolconn *c, *best;
+
+  /* notice idle connections the server has dropped, see sock_dropped */
+  for (c = pool; c < pool + npool; c++)
+    if (!c->eof && !c->inflight)
+      pool_input(c);
+  for (;;)
+    {
+      for (c = pool, best = 0; c < pool + npool; c++)
+	if (!c->broken && (!best || c->inflight + c->eof < best->inflight + best->eof))
+	  best = c;
+      if (!best)
+	dodie("connection closed by server");
+      if (!best->eof || !pool_connect(best))
+	return best;
+      best->broken = 1;
+    }
+}
+
+static void
+pool_queue(struct poolconn *c, struct poolreq *req)
+{
+  c->wbuf = dorealloc(c->wbuf, c->wlen + req->framelen);
+  memcpy(c->wbuf + c->wlen, req->frame, req->framelen);
+  c->wlen += req->framelen;
+  req->conn = c;
+  req->start = now_ms();
+  c->inflight++;
+}
+
+/* the connection is closed or broken. Without requests in flight it
+ * was just idle for too long. */
+static void
+pool_lost(struct poolconn *lost)
+{
+  struct poolconn *c;
+  struct poolreq *req;
+  int n = lost->inflight;
+
+  pool_disconnect(lost);
+  if (!n)
+    return;
+  fprintf(stderr, "connection closed by server, sending %d request%s again\n", n, n == 1 ? "" : "s");
+  if (lost->srv)
+    server_failed(lost->srv);
+  lost->inflight = 0;
+  c = pool_pick();
+  for (req = poolreqs; req; req = req->next)
+    if (req->conn == lost)
+      {
+	if (req->resent++ == POOL_RESEND_MAX)
+	  dodie("connection closed by server");
+	pool_queue(c, req);
+      }
+  pool_flush(c);
+}
+
+static void
+pool_deliver(struct poolconn *c, byte *rep, u32 len)
+{
+  struct poolreq *req, **reqp;
+  byte *buf;
+  int outl;
+
+  for (reqp = &poolreqs; (req = *reqp) != 0; reqp = &req->next)
+    if (req->id == getbe4(rep) && req->conn == c)
+      break;
+  if (!req)
+    dodie("bad reply from server");
+  *reqp = req->next;
+  free(req->frame);
+  if (c->srv)
+    server_measured(c->srv, now_ms() - req->start);
+  c->inflight--;
+  poolinflight--;
+  buf = doalloc(2 * len + 4);
+  outl = sock3_decode(rep, len, buf, 2 * len + 4, 0);
+  if (outl >= 0)
+    outl = checkreply(buf, outl, req->nret);
+  req->done(req->data, buf, outl);
+  free(buf);
+  free(req);
+}
+
+static void
+pool_input(struct poolconn *c)
+{
+  ssize_t r;
+  u32 len;
+
+  if (c->eof)
+    return;
+  for (;;)
+    {
+      if (c->rsize - c->rlen < 65536)
+	{
+	  c->rsize += 65536;
+	  c->rbuf = dorealloc(c->rbuf, c->rsize);
+	}
+      r = pool_read(c, c->rbuf + c->rlen, c->rsize - c->rlen);
+      if (r <= 0)
+	break;
+      c->rlen += r;
+    }
+  /* deliver what came in before the connection went away */
+  while (c->rlen >= 4)
+    {
+      len = getbe4(c->rbuf);
+      if (len < 12 || len > PROTO3_MAXLEN)
+	dodie("bad packet size");
+      if (c->rlen < 4 + len)
+	break;
+      pool_deliver(c, c->rbuf + 4, len);
+      memmove(c->rbuf, c->rbuf + 4 + len, c->rlen - 4 - len);
+      c->rlen -= 4 + len;
+    }
+  if (r < 0)
+    pool_lost(c);
+}
+
+/* queue a request, done is called with the answer in the format of
+ * doreq() or the negated status */
+int
+pool_submit(int argc, const char **argv, int nret, void (*done)(void *data, byte *buf, int outl), void *data)
+{
+  struct poolconn *c;
+  struct poolreq *req;
+  const byte **av;
+  int *al, i;
+  byte *frame;
+  size_t len;
+
+  av = doalloc(argc * sizeof(*av));
+  al = doalloc(argc * sizeof(*al));
+  for (i = 0; i < argc; i++)
+    {
+      av[i] = (const byte *)argv[i];
+      al[i] = strlen(argv[i]);
+    }
+  frame = sock3_encode(++sockreqid, argc, av, al, &len);
+  free(av);
+  free(al);
+  if (!frame)
+    return -1;
+  c = pool_pick();
+  req = doalloc(sizeof(*req));
+  memset(req, 0, sizeof(*req));
+  req->id = sockreqid;
+  req->nret = nret;
+  req->done = done;
+  req->data = data;
+  req->frame = frame;
+  req->framelen = len;
+  req->next = poolreqs;
+  poolreqs = req;
+  pool_queue(c, req);
+  poolinflight++;
+  pool_flush(c);
+  return 0;
+}
+
+/* number of requests in flight */
+int
+pool_pending(void)
+{
+  return poolinflight;
+}
+
+/* true if a connection has nothing to do */
+int
+pool_idle(void)
+{
+  struct poolconn *c;
+  for (c = pool; c < pool + npool; c++)
+    if (!c->broken && !c->inflight)
+      return 1;
+  return 0;
+}
+
+/* wait until replies come in or wakefd gets readable, and call the
+ * done callbacks of the replies */
+void
+pool_poll(int wakefd)
+{
+  struct pollfd *pfd;
+  struct poolconn *c;
+  int i, n = 0;
+
+#ifdef WITH_OPENSSL
+  /* data already decrypted by openssl does not show up in poll */
+  for (c = pool, i = 0; c < pool + npool; c++)
+    if (c->ssl && SSL_pending(c->ssl))
+      {
+	pool_input(c);
+	i = 1;
+      }
+  if (i)
+    return;
+#endif
+  pfd = doalloc((2 * npool + 1) * sizeof(*pfd));
+  for (c = pool; c < pool + npool; c++)
+    {
+      pfd[n].fd = c->eof ? -1 : c->fd;
+      pfd[n].events = POLLIN;
+      if (c->wlen && c->fdout == c->fd)
+	pfd[n].events |= POLLOUT;
+      n++;
+      if (c->fdout != c->fd)
+	{
+	  pfd[n].fd = c->fdout;
+	  pfd[n++].events = c->wlen ? POLLOUT : 0;
+	}
+    }
+  if (wakefd >= 0)
+    {
+      pfd[n].fd = wakefd;
+      pfd[n++].events = POLLIN;
+    }
+  while (poll(pfd, n, -1) < 0)
+    if (errno != EINTR)
+      dodie_errno("poll");
+  for (c = pool, i = 0; c < pool + npool; c++, i++)
+    {
+      int rev = pfd[i].revents;
+      if (c->fdout != c->fd)
+	rev |= pfd[++i].revents & (POLLOUT | POLLERR);
+      if (rev & (POLLIN | POLLHUP | POLLERR))
+	pool_input(c);
+      if (c->wlen && (rev & (POLLOUT | POLLIN | POLLERR)))
+	pool_flush(c);
+    }
+  if (wakefd >= 0 && pfd[n - 1].revents)
+    {
+      byte buf[256];
+      while (read(wakefd, buf, sizeof(buf)) > 0)
+	;
+    }
+  free(pfd);
+}
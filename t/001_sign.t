@@ -3,7 +3,7 @@
 use strict;
 use warnings;
 use bytes;
-use Test::More tests => 36;
+use Test::More tests => 75;
 use File::Temp qw/tempdir/;
 use File::Path qw/remove_tree make_path/;
 use Digest::SHA;
@@ -46,6 +46,10 @@ my $tmpdir = "$tmp_dir/tmp";
 mkdir($tmpdir, 0700);
 
 my $sign = "./sign --test-sign ./signd";
+my ($signd) = $sign =~ /--test-sign (\S+)/;
+(my $sign_breaklease = $sign) =~ s/--test-sign \S+/--test-sign $tmpdir\/breaklease/;
+(my $sign_v2relay = $sign) =~ s/--test-sign \S+/--test-sign $tmpdir\/v2relay/;
+(my $sign_dropconn = $sign) =~ s/--test-sign \S+/--test-sign $tmpdir\/dropconn/;
 my $result;
 
 ###############################################################################
@@ -196,6 +200,178 @@ $result = `rpm --dbpath $tmpdir --checksig -v $tmpdir/empty.rpm`;
 like($result, qr/^\s*Header V3 RSA\/SHA256 Signature, key ID [0-9a-f]*: OK/m, "Checking rpm header signature");
 like($result, qr/^\s*V3 RSA\/SHA256 Signature, key ID [0-9a-f]*: OK/m, "Checking rpm header+payload signature");
 
+###############################################################################
+### rpm inplace sign
+spew("$tmpdir/empty.rpm", slurp("$fixtures_dir/empty.rpm"));
+spew("$tmpdir/inplace.rpm", slurp("$fixtures_dir/empty.rpm"));
+$result = `$sign -T 1700000000 -h sha256 -r $tmpdir/empty.rpm`;
+$result = `$sign -T 1700000000 -h sha256 --inplace -r $tmpdir/inplace.rpm`;
+is($?, 0, "Checking rpm inplace sign return code");
+ok(slurp("$tmpdir/inplace.rpm") eq slurp("$tmpdir/empty.rpm"), "Checking rpm inplace sign result");
+ok(! -e "$tmpdir/inplace.rpm.sIgNj", "Checking rpm inplace journal removal");
+
+###############################################################################
+### rpm filter sign from a pipe
+$result = `cat $fixtures_dir/empty.rpm | $sign -T 1700000000 -h sha256 -r > $tmpdir/pipe.rpm`;
+is($?, 0, "Checking rpm pipe sign return code");
+ok(slurp("$tmpdir/pipe.rpm") eq slurp("$tmpdir/empty.rpm"), "Checking rpm pipe sign result");
+
+###############################################################################
+### rpm resign
+spew("$tmpdir/resign.rpm", slurp("$fixtures_dir/empty.rpm"));
+$result = `$sign -T 1600000000 -h sha256 -r $tmpdir/resign.rpm`;
+$result = `$sign -T 1700000000 -h sha256 --resign -r $tmpdir/resign.rpm`;
+is($?, 0, "Checking rpm resign return code");
+ok(slurp("$tmpdir/resign.rpm") eq slurp("$tmpdir/empty.rpm"), "Checking rpm resign result");
+
+###############################################################################
+### ko resign
+spew("$tmpdir/single.ko", mkelf());
+spew("$tmpdir/resign.ko", mkelf());
+spew("$tmpdir/inplace.ko", mkelf());
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --kosign $tmpdir/single.ko`;
+$result = `$sign -T 1600000000 -P $tmpdir/P --cert $tmpdir/c --kosign $tmpdir/resign.ko $tmpdir/inplace.ko`;
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --kosign --resign $tmpdir/resign.ko`;
+is($?, 0, "Checking ko resign return code");
+ok(slurp("$tmpdir/resign.ko") eq slurp("$tmpdir/single.ko"), "Checking ko resign result");
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --kosign --resign --inplace $tmpdir/inplace.ko`;
+ok(slurp("$tmpdir/inplace.ko") eq slurp("$tmpdir/single.ko"), "Checking ko inplace resign result");
+
+###############################################################################
+### appx resign
+spew("$tmpdir/single.appx", mkappx());
+spew("$tmpdir/resign.appx", mkappx());
+spew("$tmpdir/inplace.appx", mkappx());
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --appx $tmpdir/single.appx`;
+$result = `$sign -T 1600000000 -P $tmpdir/P --cert $tmpdir/c --appx $tmpdir/resign.appx $tmpdir/inplace.appx`;
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --appx --resign $tmpdir/resign.appx`;
+is($?, 0, "Checking appx resign return code");
+ok(slurp("$tmpdir/resign.appx") eq slurp("$tmpdir/single.appx"), "Checking appx resign result");
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --appx --resign --inplace $tmpdir/inplace.appx`;
+ok(slurp("$tmpdir/inplace.appx") eq slurp("$tmpdir/single.appx"), "Checking appx inplace resign result");
+
+###############################################################################
+### pe resign drops the old certificate table
+spew("$tmpdir/single.exe", mkpe());
+spew("$tmpdir/resign.exe", mkpe());
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --pesign $tmpdir/single.exe`;
+$result = `$sign -T 1600000000 -P $tmpdir/P --cert $tmpdir/c --pesign $tmpdir/resign.exe`;
+$result = `$sign -T 1700000000 -P $tmpdir/P --cert $tmpdir/c --pesign --resign --inplace $tmpdir/resign.exe`;
+is($?, 0, "Checking pe resign return code");
+ok(slurp("$tmpdir/resign.exe") eq slurp("$tmpdir/single.exe"), "Checking pe resign result");
+
+###############################################################################
+### rpm header only sign
+spew("$tmpdir/headeronly.rpm", slurp("$fixtures_dir/empty.rpm"));
+$result = `$sign -T 1700000000 -h sha256 --headeronly -r $tmpdir/headeronly.rpm`;
+is($?, 0, "Checking rpm headeronly sign return code");
+ok(rpmsigtag(slurp("$tmpdir/headeronly.rpm"), 268) eq rpmsigtag(slurp("$tmpdir/empty.rpm"), 268) && !defined(rpmsigtag(slurp("$tmpdir/headeronly.rpm"), 1002)), "Checking rpm headeronly sign result");
+
+###############################################################################
+### a harmless open for writing breaks the lease, the header is still checked
+spew("$tmpdir/leased.rpm", slurp("$fixtures_dir/empty.rpm"));
+spew("$tmpdir/breaklease", "#!/bin/sh\nperl -e 'open(F, \">>\", \$ARGV[0])' $tmpdir/leased.rpm\nexec $signd \"\$@\"\n");
+chmod(0755, "$tmpdir/breaklease");
+$result = `$sign_breaklease -T 1700000000 -h sha256 --headeronly -r $tmpdir/leased.rpm`;
+is($?, 0, "Checking rpm headeronly sign with a broken lease");
+
+###############################################################################
+### rpm bigger than 4 GiB (a sparse file)
+system("$FindBin::Bin/mkhugerpm.pl $tmpdir/huge.rpm 5120");
+is($?, 0, "Checking huge rpm creation");
+$result = `$sign -T 1700000000 -h sha256 --headeronly --inplace -r $tmpdir/huge.rpm`;
+is($?, 0, "Checking huge rpm headeronly sign return code");
+ok(-s "$tmpdir/huge.rpm" == 5120 * 1048576 && defined(rpmsigtag(slurp_head("$tmpdir/huge.rpm", 8192), 268)), "Checking huge rpm headeronly sign result");
+
+###############################################################################
+### many files in one request
+my @multi = map {"$tmpdir/multi$_"} 1 .. 5;
+spew($_, "$_\n") for @multi;
+my %single;
+for my $f (@multi) {
+  system("$sign -T 1700000000 -d $f");
+  $single{$f} = slurp("$f.asc");
+  unlink("$f.asc");
+}
+$result = `$sign -T 1700000000 -d @multi`;
+is($?, 0, "Checking multi file sign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking multi file sign result");
+for my $f (@multi) {
+  system("$sign -T 1700000000 -P $tmpdir/P -d $f");
+  $single{$f} = slurp("$f.asc");
+  unlink("$f.asc");
+}
+$result = `$sign -T 1700000000 -P $tmpdir/P -d @multi`;
+is($?, 0, "Checking multi file privsign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking multi file privsign result");
+unlink("$_.asc") for @multi;
+$result = `$sign -T 1700000000 -P $tmpdir/P -j 3 -d @multi`;
+is($?, 0, "Checking threaded multi file sign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking threaded multi file sign result");
+
+###############################################################################
+### protocol v3 gives the same result as the old protocol
+my $sign_conf_v3 = "$tmpdir/sign-v3.conf";
+spew($sign_conf_v3, slurp($sign_conf)."protocol: 3\n");
+unlink("$_.asc") for @multi;
+$result = `SIGN_CONF=$sign_conf_v3 $sign -T 1700000000 -P $tmpdir/P -d @multi`;
+is($?, 0, "Checking protocol v3 multi file sign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking protocol v3 multi file sign result");
+unlink("$_.asc") for @multi;
+$result = `SIGN_CONF=$sign_conf_v3 SIGN_PROTO=2 $sign -T 1700000000 -P $tmpdir/P -d @multi`;
+is($?, 0, "Checking old protocol multi file sign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking old protocol multi file sign result");
+$result = `SIGN_CONF=$sign_conf_v3 $sign -u unknown\@key -d $multi[0] 2>&1`;
+ok($? && $result =~ /unknown key/, "Checking protocol v3 error reply");
+
+###############################################################################
+### an old signproxy that only knows the old protocol sits in between
+spew("$tmpdir/v2relay", <<'EOF' =~ s/\@SIGND\@/$signd/r);
+#!/usr/bin/perl
+# forward one request and pass on everything until the server closes
+use IPC::Open2;
+my $req = '';
+sysread(STDIN, $req, 4 - length($req), length($req)) || exit(1) while length($req) < 4;
+my ($l1, $l2) = unpack('nn', $req);
+sysread(STDIN, $req, 4 + $l1 + $l2 - length($req), length($req)) || exit(1) while length($req) < 4 + $l1 + $l2;
+my $pid = open2(my $from, my $to, '@SIGND@', '--test-sign');
+syswrite($to, $req);
+my $buf;
+syswrite(STDOUT, $buf) while sysread($from, $buf, 8192);
+EOF
+chmod(0755, "$tmpdir/v2relay");
+unlink("$_.asc") for @multi;
+$result = `timeout 60 $sign_v2relay -T 1700000000 -P $tmpdir/P -d @multi`;
+is($?, 0, "Checking sign through an old proxy return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking sign through an old proxy result");
+$result = `timeout 60 $sign_v2relay -T 1700000000 -d $multi[0]`;
+is($?, 0, "Checking old format request through an old proxy return code");
+
+###############################################################################
+### several requests in flight over a connection pool
+unlink("$_.asc") for @multi;
+spew("$tmpdir/sign-pool.conf", slurp($sign_conf_v3)."connections: 3\n");
+$result = `SIGN_CONF=$tmpdir/sign-pool.conf $sign -T 1700000000 -P $tmpdir/P -j 2 -d @multi`;
+is($?, 0, "Checking connection pool multi file sign return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking connection pool multi file sign result");
+
+###############################################################################
+### a pool connection dies with a request in flight, it is sent again
+spew("$tmpdir/dropconn", <<'EOF' =~ s/\@SIGND\@/$signd/r =~ s/\@TMPDIR\@/$tmpdir/gr);
+#!/usr/bin/perl
+# the first server agrees to protocol v3 and dies with the first request
+exec('@SIGND@', @ARGV) if -e '@TMPDIR@/dropped' || !open(F, '>', '@TMPDIR@/dropped');
+my $buf = '';
+sysread(STDIN, $buf, 22 - length($buf), length($buf)) || exit(1) while length($buf) < 22;
+syswrite(STDOUT, pack('nnnnn', 0, 10, 0, 1, 6).'proto3');
+sysread(STDIN, $buf, 4);
+EOF
+chmod(0755, "$tmpdir/dropconn");
+unlink("$_.asc") for @multi;
+$result = `SIGN_CONF=$tmpdir/sign-pool.conf timeout 60 $sign_dropconn -T 1700000000 -P $tmpdir/P -j 2 -d @multi 2>&1`;
+ok(!$? && $result =~ /sending 1 request again/, "Checking connection pool resend return code");
+ok(!(grep {slurp("$_.asc") ne $single{$_}} @multi), "Checking connection pool resend result");
+
 ###############################################################################
 ### cleanup
 remove_tree($tmp_dir);
@@ -211,6 +387,58 @@ sub slurp {
   return $content;
 }
 
+sub slurp_head {
+  my ($fn, $len) = @_;
+  my $fh;
+  my $content = '';
+  open($fh, '<',  $fn) || die "Could not open '$fn': $!\n";
+  read($fh, $content, $len);
+  close $fh;
+  return $content;
+}
+
+sub rpmsigtag {
+  my ($rpm, $tag) = @_;
+  my ($cnt) = unpack('N', substr($rpm, 104, 4));
+  for my $i (0 .. $cnt - 1) {
+    my ($t, $type, $off, $c) = unpack('NNNN', substr($rpm, 112 + 16 * $i, 16));
+    return substr($rpm, 112 + 16 * $cnt + $off, $c) if $t == $tag;
+  }
+  return undef;
+}
+
+# a relocatable ELF file that looks enough like a kernel module
+sub mkelf {
+  return "\x7fELF\x02\x01\x01" . ("\0" x 57) . ("module data\n" x 100);
+}
+
+# a zip64 archive with the two files an appx signature needs
+sub mkappx {
+  my ($zip, $cd) = ('', '');
+  for my $f (['[Content_Types].xml', "<Types/>\n"], ['AppxBlockMap.xml', "<BlockMap/>\n"]) {
+    my ($name, $data) = @$f;
+    $cd .= pack('VvvvvVVVVvvvvvVV', 0x02014b50, 45, 20, 0, 0, 0x5a210000, 0, length($data), length($data), length($name), 0, 0, 0, 0, 0, length($zip)) . $name;
+    $zip .= pack('VvvvVVVVvv', 0x04034b50, 20, 0, 0, 0x5a210000, 0, length($data), length($data), length($name), 0) . $name . $data;
+  }
+  my $eocd64 = length($zip) + length($cd);
+  $zip .= $cd;
+  $zip .= pack('VQ<vvVVQ<Q<Q<Q<', 0x06064b50, 44, 45, 45, 0, 0, 2, 2, length($cd), $eocd64 - length($cd));
+  $zip .= pack('VVQ<V', 0x07064b50, 0, $eocd64, 1);
+  $zip .= pack('VvvvvVVv', 0x06054b50, 0, 0, 0xffff, 0xffff, 0xffffffff, 0xffffffff, 0);
+  return $zip;
+}
+
+# a PE32+ image with one section and an empty certificate table entry
+sub mkpe {
+  my $pe = pack('a2x58V', 'MZ', 0x40);
+  $pe .= pack('a4vvVVVvv', "PE\0\0", 0x8664, 1, 0, 0, 0, 240, 0x22);
+  $pe .= pack('vx58Vx44V', 0x20b, 0x200, 16) . ("\0" x 128);
+  $pe .= pack('a8VVVVx16', '.text', 0x200, 0x1000, 0x200, 0x200);
+  $pe .= "\0" x (0x200 - length($pe));
+  $pe .= "\xc3" x 0x200;
+  return $pe;
+}
+
 sub spew {
   my ($fn, $content) = @_;
   my $fh;
@@ -0,0 +1,62 @@
+#!/usr/bin/perl
+
+# Create a sparse rpm of the given size from t/fixtures/empty.rpm, for
+# testing and benchmarking the signing of rpms bigger than 4 GiB.
+# The signature header carries a LONGSIZE tag instead of SIZE, the
+# payload is padded with a hole. The payload digest no longer matches,
+# so rpm will not install the result, but sign does not care.
+#
+# usage: mkhugerpm.pl <out.rpm> <size in MiB>
+
+use strict;
+use warnings;
+use bytes;
+use Digest::SHA;
+use FindBin;
+
+my ($out, $mib) = @ARGV;
+die("usage: mkhugerpm.pl <out.rpm> <size in MiB>\n") unless $out && $mib;
+
+my $rpm;
+open(my $fh, '<', "$FindBin::Bin/fixtures/empty.rpm") || die("empty.rpm: $!\n");
+{ local $/; $rpm = <$fh>; }
+close($fh);
+
+# skip the old signature header
+my ($cnt, $dlen) = unpack('NN', substr($rpm, 96 + 8, 8));
+my $data = substr($rpm, 96 + 16 + (($cnt * 16 + $dlen + 7) & ~7));
+my ($hcnt, $hdlen) = unpack('NN', substr($data, 8, 8));
+my $hdr = substr($data, 0, 16 + 16 * $hcnt + $hdlen);
+
+# new signature header: region, sha1, longsize, sha256, reservedspace
+my $sigdata = '';
+my @entries;
+my $add = sub {
+  my ($tag, $type, $count, $d, $align) = @_;
+  $sigdata .= "\0" x ((-length($sigdata)) % $align);
+  push @entries, pack('NNNN', $tag, $type, length($sigdata), $count);
+  $sigdata .= $d;
+};
+my $size = $mib * 1048576;
+my $sigsize;
+$add->(269, 6, 1, Digest::SHA::sha1_hex($hdr) . "\0", 1);
+$add->(270, 5, 1, "\0" x 8, 8);		# filled in below
+$add->(273, 6, 1, Digest::SHA::sha256_hex($hdr) . "\0", 1);
+$add->(1008, 7, 4128, "\0" x 4128, 1);
+my $regionoff = length($sigdata);
+$sigdata .= pack('NNNN', 62, 7, -16 * (@entries + 1) & 0xffffffff, 16);
+unshift @entries, pack('NNNN', 62, 7, $regionoff, 16);
+my $sig = pack('NNNN', 0x8eade801, 0, scalar(@entries), length($sigdata)) . join('', @entries) . $sigdata;
+$sig .= "\0" x ((-length($sig)) % 8);
+my $dataoff = 96 + length($sig);
+die("size too small\n") if $size < $dataoff + length($data);
+
+# LONGSIZE is the size of header and payload
+my $longsize = $size - $dataoff;
+my $longoff = 16 + 16 * @entries + unpack('N', substr($entries[2], 8, 4));
+substr($sig, $longoff, 8) = pack('NN', int($longsize / 4294967296), $longsize % 4294967296);
+
+open($fh, '>', $out) || die("$out: $!\n");
+print $fh substr($rpm, 0, 96) . $sig . $data;
+truncate($fh, $size) || die("truncate: $!\n");
+close($fh) || die("$out: $!\n");
@@ -1,4 +1,24 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <signal.h>
+#include <linux/fs.h>
+#define STREAM_HAVE_MMAP
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define STREAM_HAVE_URING
+#endif
+#endif
+
 #include "inc.h"
+#include "bele.h"
 
 void *
 dorealloc(void *p, size_t sz)
@@ -88,10 +108,117 @@ doseek_eof(int fd, u64 pos)
   return (u64)ret;
 }
 
+#ifdef __linux__
+
+/* share the extents with the input (btrfs, xfs) */
+static u64
+docopy_clone(int infd, int outfd, u64 len)
+{
+#ifdef FICLONERANGE
+  struct file_clone_range fcr;
+  struct stat st;
+  off_t inoff, outoff;
+
+  if (fstat(outfd, &st) || !S_ISREG(st.st_mode) || st.st_blksize <= 0)
+    return 0;
+  if ((inoff = lseek(infd, 0, SEEK_CUR)) == (off_t)-1)
+    return 0;
+  if ((outoff = lseek(outfd, 0, SEEK_CUR)) == (off_t)-1)
+    return 0;
+  /* only whole blocks can be shared */
+  if (inoff % st.st_blksize || outoff % st.st_blksize)
+    return 0;
+  len -= len % st.st_blksize;
+  if (!len)
+    return 0;
+  fcr.src_fd = infd;
+  fcr.src_offset = inoff;
+  fcr.src_length = len;
+  fcr.dest_offset = outoff;
+  if (ioctl(outfd, FICLONERANGE, &fcr))
+    return 0;
+  doseek(infd, inoff + len);
+  doseek(outfd, outoff + len);
+  return len;
+#else
+  return 0;
+#endif
+}
+
+/* in-kernel copy between two regular files */
+static u64
+docopy_range(int infd, int outfd, u64 len)
+{
+  u64 done = 0;
+  while (done < len)
+    {
+      size_t chunk = len - done > 0x40000000 ? 0x40000000 : len - done;
+      ssize_t r = copy_file_range(infd, 0, outfd, 0, chunk, 0);
+      if (r < 0)
+	break;		/* not supported, let the caller continue */
+      if (r == 0)
+	dodie("unexpeced EOF");
+      done += r;
+    }
+  return done;
+}
+
+/* move the data through a pipe without copying it to user space */
+static u64
+docopy_splice(int infd, int outfd, u64 len)
+{
+  struct stat st;
+  int pfd[2], outpipe;
+  u64 done = 0;
+
+  outpipe = fstat(outfd, &st) == 0 && S_ISFIFO(st.st_mode);
+  if (!outpipe && pipe(pfd))
+    return 0;
+  while (done < len)
+    {
+      size_t chunk = len - done > 65536 ? 65536 : len - done;
+      ssize_t r = splice(infd, 0, outpipe ? outfd : pfd[1], 0, chunk, SPLICE_F_MOVE);
+      if (r < 0)
+	break;
+      if (r == 0)
+	dodie("unexpeced EOF");
+      done += r;
+      while (!outpipe && r > 0)
+	{
+	  ssize_t w = splice(pfd[0], 0, outfd, 0, r, SPLICE_F_MOVE);
+	  if (w <= 0)
+	    dodie_errno("splice");
+	  r -= w;
+	}
+    }
+  if (!outpipe)
+    {
+      close(pfd[0]);
+      close(pfd[1]);
+    }
+  return done;
+}
+
+#endif
+
+/* copy len bytes from the current position of infd to outfd. We try
+ * to let the kernel do the work: reflink, copy_file_range, splice,
+ * and fall back to a read/write loop. */
 void
 docopy(int infd, int outfd, u64 len)
 {
   unsigned char buf[65536];
+#ifdef __linux__
+  if (len >= 65536)
+    {
+      u64 done = docopy_clone(infd, outfd, len);
+      if (done < len)
+	done += docopy_range(infd, outfd, len - done);
+      if (done < len)
+	done += docopy_splice(infd, outfd, len - done);
+      len -= done;
+    }
+#endif
   while (len > 0)
     {
       size_t chunk = len > 65536 ? 65536 : len;
@@ -101,3 +228,903 @@ docopy(int infd, int outfd, u64 len)
     }
 }
 
+/* In-place modification of a file. Before the file is touched the
+ * bytes that get overwritten and the original file size are saved in
+ * an undo journal "<file>.sIgNj". The journal ends with a sha256 of
+ * its contents, the file is only touched once that is on disk. The
+ * journal is removed when the new data is on disk. If we die in between the file is restored at exit,
+ * and a journal left behind by a crash is rolled back by
+ * inplace_recover. Only one file can be modified at a time.
+ *
+ * With -j the writer thread modifies the files while other threads
+ * may call exit. The writer holds inplace_lock from inplace_begin to
+ * inplace_commit, and the exit handler takes it, so that a change in
+ * progress is finished instead of being undone under its feet.
+ */
+
+#define INPLACE_MAGIC "SIGNJRNL"
+
+static struct {
+  int fd;
+  char *journal;
+  u64 size, off, len;
+  unsigned char *data;
+} inplace = { -1 };
+
+static pthread_mutex_t inplace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t inplace_owner;
+static int inplace_locked;
+
+static char *
+inplace_journalname(const char *filename)
+{
+  char *journal = doalloc(strlen(filename) + 7);
+  sprintf(journal, "%s.sIgNj", filename);
+  return journal;
+}
+
+static void
+inplace_syncdir(const char *filename)
+{
+  const char *p = strrchr(filename, '/');
+  char *dir;
+  int fd;
+
+  if (!p)
+    dir = strdup(".");
+  else if (p == filename)
+    dir = strdup("/");
+  else
+    dir = strndup(filename, p - filename);
+  if (!dir)
+    dodie("out of memory");
+  if ((fd = open(dir, O_RDONLY)) != -1)
+    {
+      fsync(fd);
+      close(fd);
+    }
+  free(dir);
+}
+
+/* the commit record of the journal */
+static void
+inplace_checksum(const unsigned char *hdr, const unsigned char *data, u64 len, unsigned char *sum)
+{
+  SHA256_CONTEXT ctx;
+
+  sha256_init(&ctx);
+  sha256_write(&ctx, hdr, 32);
+  sha256_write(&ctx, data, len);
+  sha256_final(&ctx);
+  memcpy(sum, sha256_read(&ctx), 32);
+}
+
+static int
+inplace_restore(int fd, u64 size, u64 off, u64 len, const unsigned char *data)
+{
+  if (ftruncate(fd, (off_t)size))
+    return -1;
+  while (len > 0)
+    {
+      ssize_t r = pwrite(fd, data, len > 65536 ? 65536 : len, (off_t)off);
+      if (r < 0)
+	return -1;
+      data += r;
+      len -= r;
+      off += r;
+    }
+  return fsync(fd);
+}
+
+static void
+inplace_atexit(void)
+{
+  /* wait for a change of another thread, it is never released so
+   * that no new change can start */
+  if (!inplace_locked || !pthread_equal(inplace_owner, pthread_self()))
+    pthread_mutex_lock(&inplace_lock);
+  if (inplace.fd < 0)
+    return;
+  /* we did not get to inplace_commit, undo our changes */
+  if (inplace_restore(inplace.fd, inplace.size, inplace.off, inplace.len, inplace.data))
+    perror("restore");	/* keep the journal for inplace_recover */
+  else
+    unlink(inplace.journal);
+  inplace.fd = -1;
+}
+
+/* open the file we have read from fd for modification */
+int
+inplace_open(const char *filename, int fd, int flags)
+{
+  struct stat st1, st2;
+  int wfd;
+
+  if ((wfd = open(filename, O_RDWR | flags)) == -1)
+    dodie_errno(filename);
+  if (fstat(fd, &st1) || fstat(wfd, &st2))
+    dodie_errno("fstat");
+  if (st1.st_dev != st2.st_dev || st1.st_ino != st2.st_ino)
+    {
+      fprintf(stderr, "%s: file was replaced, bailing out!\n", filename);
+      exit(1);
+    }
+  return wfd;
+}
+
+/* save len bytes at off and the file size. The range may extend
+ * beyond the end of the file. */
+void
+inplace_begin(int fd, const char *filename, u64 off, u64 len)
+{
+  static int atexit_done;
+  unsigned char hdr[32], sum[32];
+  struct stat st;
+  int jfd;
+
+  if (inplace_locked && pthread_equal(inplace_owner, pthread_self()))
+    dodie("inplace_begin: already active");
+  pthread_mutex_lock(&inplace_lock);
+  inplace_owner = pthread_self();
+  inplace_locked = 1;
+  if (fstat(fd, &st))
+    dodie_errno("fstat");
+  if (off > (u64)st.st_size)
+    off = st.st_size;
+  if (off + len > (u64)st.st_size)
+    len = st.st_size - off;
+  inplace.data = doalloc(len);
+  doseek(fd, off);
+  doread(fd, inplace.data, len);
+  inplace.size = st.st_size;
+  inplace.off = off;
+  inplace.len = len;
+  inplace.journal = inplace_journalname(filename);
+
+  memcpy(hdr, INPLACE_MAGIC, 8);
+  setbe4(hdr + 8, inplace.size >> 32);
+  setbe4(hdr + 12, inplace.size);
+  setbe4(hdr + 16, off >> 32);
+  setbe4(hdr + 20, off);
+  setbe4(hdr + 24, len >> 32);
+  setbe4(hdr + 28, len);
+  inplace_checksum(hdr, inplace.data, len, sum);
+  if ((jfd = open(inplace.journal, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+    dodie_errno(inplace.journal);
+  dowrite(jfd, hdr, 32);
+  dowrite(jfd, inplace.data, len);
+  dowrite(jfd, sum, 32);
+  if (fsync(jfd) || close(jfd))
+    dodie_errno(inplace.journal);
+  inplace_syncdir(filename);
+  if (!atexit_done++)
+    atexit(inplace_atexit);
+  inplace.fd = fd;
+}
+
+/* the modification is complete, make it durable and drop the journal */
+void
+inplace_commit(void)
+{
+  if (inplace.fd < 0)
+    return;
+  if (fsync(inplace.fd))
+    dodie_errno("fsync");
+  inplace.fd = -1;
+  if (unlink(inplace.journal))
+    dodie_errno(inplace.journal);
+  free(inplace.journal);
+  free(inplace.data);
+  inplace.journal = 0;
+  inplace.data = 0;
+  inplace_locked = 0;
+  pthread_mutex_unlock(&inplace_lock);
+}
+
+/* roll back an in-place modification that was interrupted by a crash */
+void
+inplace_recover(const char *filename)
+{
+  char *journal = inplace_journalname(filename);
+  unsigned char hdr[32], sum[32], *data = 0;
+  u64 size, off, len;
+  struct stat st;
+  int jfd, fd;
+
+  if ((jfd = open(journal, O_RDONLY)) == -1)
+    {
+      free(journal);
+      return;
+    }
+  if (fstat(jfd, &st))
+    dodie_errno(journal);
+  if (doread_eof(jfd, hdr, 32) == 32 && !memcmp(hdr, INPLACE_MAGIC, 8))
+    {
+      size = (u64)getbe4(hdr + 8) << 32 | getbe4(hdr + 12);
+      off = (u64)getbe4(hdr + 16) << 32 | getbe4(hdr + 20);
+      len = (u64)getbe4(hdr + 24) << 32 | getbe4(hdr + 28);
+      /* an incomplete or damaged journal means that the file was not
+       * touched yet */
+      if ((u64)st.st_size == 32 + len + 32)
+	{
+	  data = doalloc(len + 32);
+	  doread(jfd, data, len + 32);
+	  inplace_checksum(hdr, data, len, sum);
+	}
+      if (data && !memcmp(data + len, sum, 32))
+	{
+	  if ((fd = open(filename, O_RDWR)) == -1)
+	    dodie_errno(filename);
+	  if (inplace_restore(fd, size, off, len, data))
+	    dodie_errno(filename);
+	  close(fd);
+	  fprintf(stderr, "%s: rolled back interrupted in-place signing\n", filename);
+	}
+      free(data);
+    }
+  close(jfd);
+  if (unlink(journal))
+    dodie_errno(journal);
+  inplace_syncdir(filename);
+  free(journal);
+}
+
+/* Streaming reader for the hashing loops. Regular files on local
+ * filesystems are mapped and handed out straight from the page cache.
+ * Otherwise several large buffers are kept in flight so that the disk
+ * is busy while we hash. The data is read with io_uring if the kernel
+ * supports it, otherwise a helper thread does the preads. Pipes and
+ * small ranges are read directly. The SIGN_IO environment variable
+ * ("mmap", "uring", "thread", "read") selects a backend, which is
+ * useful for testing.
+ */
+
+#define STREAM_NBUF	4
+#define STREAM_BUFSIZE	(1 << 20)
+
+#define STREAM_READ	0
+#define STREAM_THREAD	1
+#define STREAM_URING	2
+#define STREAM_MMAP	3
+
+#define STREAM_MAPCHUNK	(8 << 20)
+
+#define STREAM_BUF_FREE	0
+#define STREAM_BUF_BUSY	1
+#define STREAM_BUF_DONE	2
+
+struct stream_buf {
+  unsigned char *data;
+  u64 off;		/* file offset of the data */
+  size_t req;		/* number of bytes requested */
+  ssize_t res;		/* number of bytes read or -errno */
+  int state;
+};
+
+#ifdef STREAM_HAVE_URING
+struct stream_uring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+#endif
+
+struct stream {
+  int fd;
+  int backend;
+  int seekable;
+  int nbuf;
+  size_t bufsize;
+  u64 end;		/* end of the range to read, STREAM_TOEOF for no end */
+  u64 planend;		/* end of the read-ahead */
+  u64 sub;		/* offset of the next read to start */
+  u64 pos;		/* offset of the next byte handed out */
+  int next;		/* next buffer to hand out */
+  int held;		/* buffer the caller is working on, -1 if none */
+  struct stream_buf bufs[STREAM_NBUF];
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+#ifdef STREAM_HAVE_URING
+  struct stream_uring ring;
+#endif
+  unsigned char *map;	/* STREAM_MMAP: mapping of the planned range */
+  size_t maplen;
+  u64 mapoff;		/* file offset of the mapping */
+  int mapslot;
+  volatile sig_atomic_t truncated;	/* set by the SIGBUS handler */
+};
+
+static int stream_backend = -1;
+
+/* read until the request is complete or we hit EOF */
+static ssize_t
+stream_pread(struct stream *st, struct stream_buf *b, size_t have)
+{
+  while (have < b->req)
+    {
+      ssize_t r = pread(st->fd, b->data + have, b->req - have, (off_t)(b->off + have));
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r < 0)
+	return -errno;
+      if (r == 0)
+	break;
+      have += r;
+    }
+  return have;
+}
+
+#ifdef STREAM_HAVE_URING
+
+static int
+stream_uring_setup(struct stream *st)
+{
+  struct stream_uring *ring = &st->ring;
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, STREAM_NBUF, &p);
+  if (ring->fd < 0)
+    return -1;
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_size > ring->sq_size)
+    ring->sq_size = ring->cq_size;
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    {
+      close(ring->fd);
+      return -1;
+    }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+    {
+      ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+	{
+	  munmap(ring->sq_ptr, ring->sq_size);
+	  close(ring->fd);
+	  return -1;
+	}
+    }
+  ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      if (ring->cq_ptr != ring->sq_ptr)
+	munmap(ring->cq_ptr, ring->cq_size);
+      munmap(ring->sq_ptr, ring->sq_size);
+      close(ring->fd);
+      return -1;
+    }
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+  return 0;
+}
+
+static void
+stream_uring_free(struct stream *st)
+{
+  struct stream_uring *ring = &st->ring;
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+}
+
+static void
+stream_uring_submit(struct stream *st, int i)
+{
+  struct stream_uring *ring = &st->ring;
+  struct stream_buf *b = st->bufs + i;
+  unsigned tail = *ring->sq_tail;
+  unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + idx;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = st->fd;
+  sqe->off = b->off;
+  sqe->addr = (unsigned long)b->data;
+  sqe->len = b->req;
+  sqe->user_data = i;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, 0, 0) < 0)
+    if (errno != EINTR)
+      dodie_errno("io_uring_enter");
+}
+
+/* reap completions until buffer i is done */
+static void
+stream_uring_wait(struct stream *st, int i)
+{
+  struct stream_uring *ring = &st->ring;
+
+  for (;;)
+    {
+      unsigned head = *ring->cq_head;
+      unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++)
+	{
+	  struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+	  struct stream_buf *b = st->bufs + cqe->user_data;
+	  b->res = cqe->res;
+	  b->state = STREAM_BUF_DONE;
+	}
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+      if (i < 0 || st->bufs[i].state == STREAM_BUF_DONE)
+	return;
+      if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+	dodie_errno("io_uring_enter");
+    }
+}
+
+#endif
+
+static void *
+stream_thread(void *arg)
+{
+  struct stream *st = arg;
+  struct stream_buf *b;
+  int i = 0;
+
+  pthread_mutex_lock(&st->lock);
+  for (;;)
+    {
+      b = st->bufs + i;
+      while (b->state != STREAM_BUF_BUSY && !st->stop)
+	pthread_cond_wait(&st->cond, &st->lock);
+      if (st->stop)
+	break;
+      pthread_mutex_unlock(&st->lock);
+      b->res = stream_pread(st, b, 0);
+      pthread_mutex_lock(&st->lock);
+      b->state = STREAM_BUF_DONE;
+      pthread_cond_broadcast(&st->cond);
+      i = (i + 1) % st->nbuf;
+    }
+  pthread_mutex_unlock(&st->lock);
+  return 0;
+}
+
+/* start reading into buffer i if there is something left to read */
+static void
+stream_submit(struct stream *st, int i)
+{
+  struct stream_buf *b = st->bufs + i;
+
+  if (st->sub >= st->planend)
+    return;
+  b->off = st->sub;
+  b->req = st->planend - st->sub > st->bufsize ? st->bufsize : st->planend - st->sub;
+  b->res = 0;
+  st->sub += b->req;
+#ifdef STREAM_HAVE_URING
+  if (st->backend == STREAM_URING)
+    {
+      b->state = STREAM_BUF_BUSY;
+      stream_uring_submit(st, i);
+      return;
+    }
+#endif
+  pthread_mutex_lock(&st->lock);
+  b->state = STREAM_BUF_BUSY;
+  pthread_cond_broadcast(&st->cond);
+  pthread_mutex_unlock(&st->lock);
+}
+
+static void
+stream_wait(struct stream *st, int i)
+{
+#ifdef STREAM_HAVE_URING
+  if (st->backend == STREAM_URING)
+    {
+      stream_uring_wait(st, i);
+      return;
+    }
+#endif
+  pthread_mutex_lock(&st->lock);
+  while (st->bufs[i].state != STREAM_BUF_DONE)
+    pthread_cond_wait(&st->cond, &st->lock);
+  pthread_mutex_unlock(&st->lock);
+}
+
+/* hand buffer i back and start the next read into it. The reader
+ * thread looks at the state under the lock. */
+static void
+stream_release(struct stream *st, int i)
+{
+  if (st->backend == STREAM_THREAD)
+    pthread_mutex_lock(&st->lock);
+  st->bufs[i].state = STREAM_BUF_FREE;
+  if (st->backend == STREAM_THREAD)
+    pthread_mutex_unlock(&st->lock);
+  stream_submit(st, i);
+}
+
+/* wait for all reads that are still in flight */
+static void
+stream_drain(struct stream *st)
+{
+  int i;
+  if (st->backend == STREAM_READ)
+    return;
+  if (st->backend == STREAM_THREAD)
+    {
+      pthread_mutex_lock(&st->lock);
+      for (i = 0; i < st->nbuf; i++)
+	while (st->bufs[i].state == STREAM_BUF_BUSY)
+	  pthread_cond_wait(&st->cond, &st->lock);
+      pthread_mutex_unlock(&st->lock);
+    }
+  else
+    {
+      for (i = 0; i < st->nbuf; i++)
+	if (st->bufs[i].state == STREAM_BUF_BUSY)
+	  stream_wait(st, i);
+    }
+  st->sub = st->planend = st->pos;
+}
+
+#ifdef STREAM_HAVE_MMAP
+
+/* Up to STREAM_NMAPS streams, one per -j reader thread, can use a
+ * mapping at the same time. They are registered in slots so that the
+ * SIGBUS handler knows where to look. A stream that finds all slots
+ * taken uses the read-ahead buffers instead. */
+#define STREAM_NMAPS	16
+
+static struct stream *stream_mapped[STREAM_NMAPS];
+static int stream_nmapped;		/* installs the handler when > 0 */
+static pthread_mutex_t stream_maplock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long stream_pagesize;
+static struct sigaction stream_oldbus;
+
+/* The file got truncated under the mapping. Map zeros over the page so
+ * that the hashing can go on, stream_read then reports the problem. */
+static void
+stream_sigbus(int sig, siginfo_t *si, void *uctx)
+{
+  unsigned char *addr = si->si_addr;
+  struct stream *st;
+  int i;
+
+  for (i = 0; i < STREAM_NMAPS; i++)
+    {
+      st = __atomic_load_n(stream_mapped + i, __ATOMIC_SEQ_CST);
+      if (st && st->map && addr >= st->map && addr < st->map + st->maplen)
+	{
+	  void *page = (void *)((unsigned long)addr & ~(stream_pagesize - 1));
+	  if (mmap(page, stream_pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+	    break;
+	  st->truncated = 1;
+	  return;
+	}
+    }
+  /* not ours, let the fault kill us */
+  sigaction(SIGBUS, &stream_oldbus, 0);
+}
+
+/* the page cache of network filesystems may not be coherent, read
+ * those files instead */
+static int
+stream_localfs(int fd)
+{
+  static const unsigned long remote[] = {
+    0x6969,		/* nfs */
+    0x517b,		/* smb */
+    0xff534d42,		/* cifs */
+    0xfe534d42,		/* smb2 */
+    0x65735546,		/* fuse */
+    0x00c36400,		/* ceph */
+    0x01021997,		/* 9p */
+    0x47504653,		/* gpfs */
+    0x0bd00bd0,		/* lustre */
+  };
+  struct statfs stfs;
+  int i;
+
+  if (fstatfs(fd, &stfs))
+    return 0;
+  for (i = 0; i < sizeof(remote) / sizeof(*remote); i++)
+    if ((unsigned long)(unsigned int)stfs.f_type == remote[i])
+      return 0;
+  return 1;
+}
+
+static int
+stream_map(struct stream *st)
+{
+  struct stream *none;
+  struct sigaction sa;
+  u64 mapend = st->planend;
+  int i;
+
+  if (!stream_localfs(st->fd))
+    return -1;
+  for (i = 0; i < STREAM_NMAPS; i++)
+    {
+      none = 0;
+      if (__atomic_compare_exchange_n(stream_mapped + i, &none, st, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	break;
+    }
+  if (i == STREAM_NMAPS)
+    return -1;
+  st->mapslot = i;
+  if (!stream_pagesize)
+    stream_pagesize = sysconf(_SC_PAGESIZE);
+  st->mapoff = st->pos & ~(u64)(stream_pagesize - 1);
+  if (mapend - st->mapoff != (size_t)(mapend - st->mapoff))
+    goto fail;
+  st->maplen = mapend - st->mapoff;
+  st->map = mmap(0, st->maplen, PROT_READ, MAP_SHARED, st->fd, (off_t)st->mapoff);
+  if (st->map == MAP_FAILED)
+    {
+      st->map = 0;
+      goto fail;
+    }
+  madvise(st->map, st->maplen, MADV_SEQUENTIAL);
+  madvise(st->map, st->maplen, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+  madvise(st->map, st->maplen, MADV_HUGEPAGE);
+#endif
+  st->truncated = 0;
+  pthread_mutex_lock(&stream_maplock);
+  if (stream_nmapped++ == 0)
+    {
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = stream_sigbus;
+      sa.sa_flags = SA_SIGINFO;
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGBUS, &sa, &stream_oldbus);
+    }
+  pthread_mutex_unlock(&stream_maplock);
+  return 0;
+fail:
+  __atomic_store_n(stream_mapped + st->mapslot, 0, __ATOMIC_SEQ_CST);
+  return -1;
+}
+
+static void
+stream_unmap(struct stream *st)
+{
+  pthread_mutex_lock(&stream_maplock);
+  if (--stream_nmapped == 0)
+    sigaction(SIGBUS, &stream_oldbus, 0);
+  pthread_mutex_unlock(&stream_maplock);
+  munmap(st->map, st->maplen);
+  st->map = 0;
+  __atomic_store_n(stream_mapped + st->mapslot, 0, __ATOMIC_SEQ_CST);
+}
+
+static void
+stream_checkmap(struct stream *st)
+{
+  if (st->truncated)
+    dodie("file was truncated while reading");
+}
+
+#endif
+
+static int
+stream_getbackend(void)
+{
+  if (stream_backend < 0)
+    {
+      const char *e = getenv("SIGN_IO");
+      stream_backend = STREAM_MMAP;
+      if (e && !strcmp(e, "uring"))
+	stream_backend = STREAM_URING;
+      else if (e && !strcmp(e, "thread"))
+	stream_backend = STREAM_THREAD;
+      else if (e && !strcmp(e, "read"))
+	stream_backend = STREAM_READ;
+#ifndef STREAM_HAVE_MMAP
+      if (stream_backend == STREAM_MMAP)
+	stream_backend = STREAM_URING;
+#endif
+#ifndef STREAM_HAVE_URING
+      if (stream_backend == STREAM_URING)
+	stream_backend = STREAM_THREAD;
+#endif
+    }
+  return stream_backend;
+}
+
+/* read len bytes (or up to EOF for STREAM_TOEOF) starting at the
+ * current position of fd */
+struct stream *
+stream_open(int fd, u64 len)
+{
+  struct stream *st = doalloc(sizeof(*st));
+  struct stat stb;
+  off_t cur;
+  u64 plan;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  st->fd = fd;
+  st->held = -1;
+  st->backend = STREAM_READ;
+  cur = lseek(fd, 0, SEEK_CUR);
+  st->seekable = cur != (off_t)-1 && !fstat(fd, &stb) && S_ISREG(stb.st_mode);
+  st->pos = st->sub = st->seekable ? (u64)cur : 0;
+  st->end = len == STREAM_TOEOF ? STREAM_TOEOF : st->pos + len;
+  plan = 0;
+  if (st->seekable)
+    {
+      /* read ahead up to the current file size */
+      plan = (u64)stb.st_size > st->pos ? (u64)stb.st_size - st->pos : 0;
+      if (len != STREAM_TOEOF && len < plan)
+	plan = len;
+    }
+  st->planend = st->pos + plan;
+  st->bufsize = STREAM_BUFSIZE;
+  if (plan > STREAM_BUFSIZE)
+    st->backend = stream_getbackend();
+  else if (plan)
+    st->bufsize = (plan + 4095) & ~(size_t)4095;
+#ifdef STREAM_HAVE_MMAP
+  if (st->backend == STREAM_MMAP && stream_map(st))
+    st->backend = STREAM_URING;	/* busy, remote, or cannot be mapped */
+#endif
+#ifndef STREAM_HAVE_URING
+  if (st->backend == STREAM_URING)
+    st->backend = STREAM_THREAD;
+#endif
+  /* the mapping only needs a buffer if the file grows */
+  st->nbuf = st->backend == STREAM_READ || st->backend == STREAM_MMAP ? 1 : STREAM_NBUF;
+  for (i = 0; i < st->nbuf; i++)
+    if (posix_memalign((void **)&st->bufs[i].data, 4096, st->bufsize))
+      dodie("out of memory");
+#ifdef STREAM_HAVE_URING
+  if (st->backend == STREAM_URING && stream_uring_setup(st))
+    st->backend = stream_backend = STREAM_THREAD;	/* no io_uring, don't try again */
+#endif
+  if (st->backend == STREAM_THREAD)
+    {
+      pthread_mutex_init(&st->lock, 0);
+      pthread_cond_init(&st->cond, 0);
+      if (pthread_create(&st->thread, 0, stream_thread, st))
+	{
+	  pthread_mutex_destroy(&st->lock);
+	  pthread_cond_destroy(&st->cond);
+	  st->backend = STREAM_READ;
+	}
+    }
+  if (st->backend == STREAM_READ)
+    st->sub = st->planend = st->pos;
+  if (st->backend == STREAM_MMAP)
+    st->sub = st->planend;	/* nothing to submit */
+  for (i = 0; i < st->nbuf; i++)
+    stream_submit(st, i);
+  return st;
+}
+
+/* return the next chunk of data, 0 at EOF. The data stays valid until
+ * the next call. */
+size_t
+stream_read(struct stream *st, const unsigned char **bufp)
+{
+  struct stream_buf *b;
+  size_t chunk;
+  ssize_t r;
+
+  if (st->held >= 0)
+    {
+      stream_release(st, st->held);
+      st->held = -1;
+    }
+#ifdef STREAM_HAVE_MMAP
+  if (st->backend == STREAM_MMAP)
+    {
+      stream_checkmap(st);
+      if (st->pos < st->end && st->pos < st->planend)
+	{
+	  /* straight from the mapping */
+	  chunk = st->planend - st->pos > STREAM_MAPCHUNK ? STREAM_MAPCHUNK : st->planend - st->pos;
+	  if (st->end - st->pos < chunk)
+	    chunk = st->end - st->pos;
+	  *bufp = st->map + (st->pos - st->mapoff);
+#ifdef MADV_POPULATE_READ
+	  {
+	    /* map the whole chunk at once instead of faulting in every page */
+	    unsigned char *start = (unsigned char *)((unsigned long)*bufp & ~(stream_pagesize - 1));
+	    madvise(start, *bufp + chunk - start, MADV_POPULATE_READ);
+	  }
+#endif
+	  st->pos += chunk;
+	  return chunk;
+	}
+    }
+#endif
+  if (st->pos >= st->end)
+    return 0;
+  if (st->pos < st->planend)
+    {
+      /* a read-ahead buffer */
+      b = st->bufs + st->next;
+      stream_wait(st, st->next);
+      r = b->res;
+      if (r == -EINVAL || r == -EOPNOTSUPP)
+	r = 0;		/* IORING_OP_READ is not supported */
+      if (r >= 0 && (size_t)r < b->req)
+	r = stream_pread(st, b, r);
+      if (r < 0)
+	{
+	  errno = -r;
+	  dodie_errno("read");
+	}
+      st->held = st->next;
+      st->next = (st->next + 1) % st->nbuf;
+      if ((size_t)r < b->req)
+	stream_drain(st);	/* the file got shorter */
+      st->pos += r;
+      *bufp = b->data;
+      return r;
+    }
+  /* read directly, e.g. a pipe or a file that keeps growing */
+  stream_drain(st);
+  b = st->bufs + st->next;
+  chunk = st->end - st->pos > st->bufsize ? st->bufsize : st->end - st->pos;
+  for (;;)
+    {
+      r = st->seekable ? pread(st->fd, b->data, chunk, (off_t)st->pos) : read(st->fd, b->data, chunk);
+      if (r >= 0 || errno != EINTR)
+	break;
+    }
+  if (r < 0)
+    dodie_errno("read");
+  st->pos += r;
+  *bufp = b->data;
+  return r;
+}
+
+/* free the reader and leave the file position after the consumed data */
+void
+stream_close(struct stream *st)
+{
+  int i;
+
+  stream_drain(st);
+  if (st->backend == STREAM_THREAD)
+    {
+      pthread_mutex_lock(&st->lock);
+      st->stop = 1;
+      pthread_cond_broadcast(&st->cond);
+      pthread_mutex_unlock(&st->lock);
+      pthread_join(st->thread, 0);
+      pthread_mutex_destroy(&st->lock);
+      pthread_cond_destroy(&st->cond);
+    }
+#ifdef STREAM_HAVE_URING
+  if (st->backend == STREAM_URING)
+    stream_uring_free(st);
+#endif
+#ifdef STREAM_HAVE_MMAP
+  if (st->backend == STREAM_MMAP)
+    {
+      stream_unmap(st);
+      stream_checkmap(st);
+    }
+#endif
+  if (st->seekable)
+    doseek(st->fd, st->pos);
+  for (i = 0; i < st->nbuf; i++)
+    free(st->bufs[i].data);
+  free(st);
+}
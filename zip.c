@@ -55,7 +55,7 @@ zip_read(struct zip *zip, int fd)
   if (size >= 0x100000000000ULL)
     dodie("zip archive too big");
   size += 20 + 22;
-  zip->size = size;
+  zip->size = zip->filesize = size;
   doread(fd, eocd64l, 20);
   doread(fd, eocd, 22);
   if (getle4(eocd) != 0x06054b50 || getle2(eocd + 20) != 0)
@@ -184,6 +184,40 @@ zip_seekdata(struct zip *zip, int fd, unsigned char *entry)
   return size;
 }
 
+/* remove a file that was appended last, e.g. an old signature. The
+ * archive is cut before its file header. Returns 0 if the file is not
+ * the last one in the archive. */
+int
+zip_removelast(struct zip *zip, char *fn)
+{
+  unsigned char *iter = zip->cd;
+  unsigned char *entry, *e;
+  u64 pos, entrysize;
+
+  if (zip->appendedsize)
+    dodie("zip_removelast: files already appended");
+  entry = zip_findentry(zip, fn);
+  if (!entry)
+    return 0;
+  pos = zip_entry_fhpos(entry);
+  while ((e = zip_iterentry(zip, &iter)) != 0)
+    if (e != entry && zip_entry_fhpos(e) >= pos)
+      return 0;
+  entrysize = 46 + getle2(entry + 28) + getle2(entry + 30) + getle2(entry + 32);
+  memmove(entry, entry + entrysize, zip->cd + zip->cd_size - (entry + entrysize));
+  zip->cd_size -= entrysize;
+  zip->num--;
+  zip->cd_offset = pos;
+  zip->size = zip->cd_offset + zip->cd_size + zip->eocd_size + 20 + 22;
+
+  /* patch eocd entries */
+  setle8(zip->eocd + 24, zip->num);
+  setle8(zip->eocd + 32, zip->num);
+  setle8(zip->eocd + 40, zip->cd_size);
+  setle8(zip->eocd + 48, zip->cd_offset);
+  return 1;
+}
+
 void
 zip_free(struct zip *zip)
 {
@@ -337,12 +371,10 @@ zip_appendfile(struct zip *zip, char *fn, unsigned char *file, u64 filelen, int
     free(compfile);
 }
 
-void
-zip_write(struct zip *zip, int zipfd, int fd)
+/* the zip64 end of central directory locator and the end record */
+static void
+zip_endrecords(struct zip *zip, unsigned char *eocdl, unsigned char *eocdr)
 {
-  unsigned char eocdl[20];
-  unsigned char eocdr[22];
-
   setle4(eocdl, 0x07064b50);
   setle4(eocdl + 4, 0);
   setle8(eocdl + 8, zip->cd_offset + zip->cd_size);
@@ -356,10 +388,31 @@ zip_write(struct zip *zip, int zipfd, int fd)
   setle4(eocdr + 12, 0xffffffff);
   setle4(eocdr + 16, 0xffffffff);
   setle2(eocdr + 20, 0);
+}
 
-  /* copy old */
-  doseek(zipfd, 0);
-  docopy(zipfd, fd, zip->cd_offset - zip->appendedsize);
+/* return the data from the central directory to the end, as
+ * zip_writetail writes it */
+unsigned char *
+zip_gettail(struct zip *zip, u64 *lenp)
+{
+  unsigned char *tail = doalloc(zip->cd_size + zip->eocd_size + 20 + 22);
+
+  memcpy(tail, zip->cd, zip->cd_size);
+  memcpy(tail + zip->cd_size, zip->eocd, zip->eocd_size);
+  zip_endrecords(zip, tail + zip->cd_size + zip->eocd_size, tail + zip->cd_size + zip->eocd_size + 20);
+  *lenp = zip->cd_size + zip->eocd_size + 20 + 22;
+  return tail;
+}
+
+/* write the appended files, the central directory and the zip64 end
+ * of central directory records */
+static void
+zip_writetail(struct zip *zip, int fd)
+{
+  unsigned char eocdl[20];
+  unsigned char eocdr[22];
+
+  zip_endrecords(zip, eocdl, eocdr);
   dowrite(fd, zip->appended, zip->appendedsize);
   dowrite(fd, zip->cd, zip->cd_size);	/* central dir */
   dowrite(fd, zip->eocd, zip->eocd_size);	/* end of central dir */
@@ -367,3 +420,35 @@ zip_write(struct zip *zip, int zipfd, int fd)
   dowrite(fd, eocdr, 22);
 }
 
+void
+zip_write(struct zip *zip, int zipfd, int fd)
+{
+  /* copy old */
+  doseek(zipfd, 0);
+  docopy(zipfd, fd, zip->cd_offset - zip->appendedsize);
+  zip_writetail(zip, fd);
+}
+
+/* update the zip in place: cut it at the old central directory and
+ * write the new tail. The old tail is kept in the in-place journal
+ * so that an interrupted run can be rolled back. */
+void
+zip_write_inplace(struct zip *zip, int zipfd, char *filename)
+{
+  u64 cut = zip->cd_offset - zip->appendedsize;
+  int fd;
+
+  fd = inplace_open(filename, zipfd, 0);
+  if (doseek_eof(fd, 0) != zip->filesize)
+    {
+      fprintf(stderr, "%s: file has changed, bailing out!\n", filename);
+      exit(1);
+    }
+  inplace_begin(fd, filename, cut, zip->filesize - cut);
+  if (ftruncate(fd, (off_t)cut))
+    dodie_errno("ftruncate");
+  doseek(fd, cut);
+  zip_writetail(zip, fd);
+  inplace_commit();
+  close(fd);
+}